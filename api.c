@@ -22,8 +22,11 @@
 #include "hash.h"
 #include "host.h"
 #include "map.h"
+#include "preload.h"
+#include "stamp.h"
 #include "exec.h"
 #include "miner.h"
+#include "testall.h"
 #include "api.h"
 
 
@@ -68,19 +71,17 @@ static const char *status_name[] = {
 };
 
 
-static const char *delta_state(struct delta *d)
+static const char *delta_state(const struct delta *d)
 {
+	const struct change *ch;
 	bool add = 0;
 	bool del = 0;
 
-	while (d) {
-		del |= d->old &&
-		    (!d->new || strcmp(d->old, d->new));
-		add |= (!d->old && d->new) ||
-		    (d->old && d->new && strcmp(d->old, d->new));
+	for (ch = d->changes; ch != d->changes + d->n; ch++) {
+		del |= ch->old != NULL;
+		add |= ch->new != NULL;
 		if (add && del)
 			return "change";
-		d = d->next;
 	}
 	if (add)
 		return "add";
@@ -98,24 +99,18 @@ char *miners_json(void)
 	for (m = miners; m; m = m->next) {
 		char *name = string_or_null(m->name);
 		char *ipv4 = quad_or_null(m->mqtt.ipv4);
-		char *hash = m->config ? config_hash(m->config) : NULL;
-		char *miner_hash = string_or_null(m->config ? hash : NULL);
+		char *miner_hash = string_or_null(m->config_hash);
 		char *delta_hash = NULL;
 		const char *state = status_name[m->state];
 		char *error = string_or_null(m->error);
 		char *restart = string_or_null(m->restart);
 		char *new;
 
-		free(hash);
 		if (m->delta) {
-			char *tmp;
-
 			state = delta_state(m->delta);
 			if (strcmp(state, "same") && m->cooldown > now)
 				state = "updating";
-			tmp = config_hash_delta(m->delta);
-			delta_hash = string_or_null(tmp);
-			free(tmp);
+			delta_hash = string_or_null(m->delta_hash);
 		}
 		asprintf_req(&new,
 		    "%s{ \"id\":%u, \"name\":%s, \"ipv4\":%s, "
@@ -147,16 +142,19 @@ char *miners_json(void)
 static char *delta_string(const struct miner *m)
 {
 	char *s = stralloc("");
-	struct delta *d;
+	struct delta_iter it;
+	bool first = 1;
 	char *new;
 
-	for (d = m->delta; d; d = d->next) {
-		char *old_value = string_or_null(d->old);
-		char *new_value = string_or_null(d->new);
+	delta_iter_init(&it, m->delta);
+	while (delta_next(&it)) {
+		char *old_value = string_or_null(it.old);
+		char *new_value = string_or_null(it.new);
 
 		asprintf_req(&new,
 		    "%s{ \"name\":\"%s\", \"old\":%s, \"new\":%s }",
-		    d == m->delta ? "" : ",\n", d->name, old_value, new_value);
+		    first ? "" : ",\n", it.name, old_value, new_value);
+		first = 0;
 		free(old_value);
 		free(new_value);
 		s = stralloc_append(s, new);
@@ -198,7 +196,7 @@ char *miner_json(uint32_t id)
 	name = string_or_null(m->name);
 	serial0 = string_or_null(m->serial[0]);
 	serial1 = string_or_null(m->serial[1]);
-	hash = config_hash_delta(m->delta);
+	hash = m->delta ? stralloc(m->delta_hash) : config_hash_delta(NULL);
 
 	if (m->delta)
 		list = delta_string(m);
@@ -270,16 +268,8 @@ char *miner_update_group(const char *hash, bool restart)
 			continue;
 		if (delta_same(m->delta))
 			continue;
-		if (hash != NULL) {
-			char *tmp;
-			bool match;
-
-			tmp = config_hash_delta(m->delta);
-			match = !strcmp(hash, tmp);
-			free(tmp);
-			if (!match)
-				continue;
-		}
+		if (hash != NULL && strcmp(hash, m->delta_hash))
+			continue;
 		consider_updating(m, 1, restart);
 		n++;
 	}
@@ -354,11 +344,60 @@ static char *run_result(char *error, struct delta *delta)
 }
 
 
+/*
+ * The test rules are kept between runs, and only parsed again if the rules
+ * file has changed. Likewise, map and host files in the test directory are
+ * reloaded if they have changed. (Unless a fleet-wide test run is using them.)
+ * Dropping files invalidates all file bindings, so we bind the active rules
+ * again.
+ */
+
+static struct rule *test_rules = NULL;
+static struct stamp test_stamp;
+
+
+/*
+ * Files that can't be preloaded don't keep us from running the rules. If the
+ * rules actually use such a file, running them reports the error.
+ */
+
+static const struct rule *get_test_rules(void)
+{
+	const char *name = TEST_DIR "/" SCRIPT_NAME;
+	bool expired = 0;
+
+	if (!test_all_running()) {
+		expired = expire_host_files(TEST_DIR);
+		expired = expire_map_files(TEST_DIR) || expired;
+	}
+
+	/* stamp_changed updates the stamp, so we read the file only once */
+	if (!test_stamp.hash) {
+		stamp_init(&test_stamp, name);
+	} else if (!stamp_changed(&test_stamp, name)) {
+		if (expired)
+			free(preload_files(test_rules, TEST_DIR));
+		return test_rules;
+	}
+
+	free_rules(test_rules);
+	test_rules = rules_file(name);
+	if (get_error()) {
+		free_rules(test_rules);
+		test_rules = NULL;
+		stamp_free(&test_stamp);
+	} else {
+		free(preload_files(test_rules, TEST_DIR));
+	}
+	return test_rules;
+}
+
+
 char *miner_run(uint32_t id)
 {
 	struct miner_env env;
 	struct miner *m;
-	struct rule *rules;
+	const struct rule *rules;
 	char *error = NULL;
 	struct delta *delta = NULL;
 
@@ -370,17 +409,15 @@ char *miner_run(uint32_t id)
 		    NULL);
 
 	report = report_store;
-	rules = rules_file(TEST_DIR "/" SCRIPT_NAME);
+	rules = get_test_rules();
 	report = report_fatal;
 	if (get_error()) {
 		error = stralloc(get_error());
 		clear_error();
-		free_rules(rules);
 		return run_result(error, NULL);
 	}
 
-	miner_calculate(&env, m, TEST_DIR, rules);
-	free_rules(rules);
+	miner_calculate(&env, m, TEST_DIR, rules, 1);
 	miner_calculation_finish(&env, &error, &delta);
 
 	return run_result(error, delta);
@@ -390,14 +427,44 @@ char *miner_run(uint32_t id)
 /* ----- POST /reload ------------------------------------------------------ */
 
 
+/*
+ * Problems with the files the rules use, and assignments some miners would
+ * reject, don't keep the rules from being activated, since they may only
+ * affect rules that don't apply to any miner. We report them after
+ * activating the rules.
+ */
+
+static char *reload_warnings(char *unloaded, char *invalid)
+{
+	char *s;
+
+	if (!unloaded && !invalid)
+		return stralloc("");
+	s = stralloc("Rules activated, but");
+	if (unloaded) {
+		s = stralloc_append(s, " some files could not be loaded:\n");
+		s = stralloc_append(s, unloaded);
+		free(unloaded);
+		if (invalid)
+			s = stralloc_append(s, "\nand");
+	}
+	if (invalid) {
+		s = stralloc_append(s, " some miners would reject:\n");
+		s = stralloc_append(s, invalid);
+		free(invalid);
+	}
+	return s;
+}
+
+
 char *miner_reload(void)
 {
 	struct rule *rules;
 	struct miner *m;
-	char *error;
+	char *error, *unloaded, *invalid;
 
-	free_host_files();
-	free_map_files();
+	expire_host_files(ACTIVE_DIR);
+	expire_map_files(ACTIVE_DIR);
 
 	report = report_store;
 	rules = rules_file(ACTIVE_DIR "/" SCRIPT_NAME);
@@ -406,22 +473,27 @@ char *miner_reload(void)
 		error = stralloc(get_error());
 		clear_error();
 		free_rules(rules);
+		/* files we dropped may have been bound to the old rules */
+		bind_files(active_rules, ACTIVE_DIR);
 		return error;
 	}
 
+	unloaded = preload_files(rules, ACTIVE_DIR);
+	invalid = prevalidate(rules);
 	free_rules(active_rules);
 	active_rules = rules;
 
 	for (m = miners; m; m = m->next) {
 		struct miner_env env;
+		struct delta *delta;
 
 		if (!miner_can_calculate(m))
 			continue;
-		miner_calculate(&env, m, ACTIVE_DIR, active_rules);
+		miner_calculate(&env, m, ACTIVE_DIR, active_rules, 0);
 		free(m->error);
-		config_free_delta(m->delta);
-		miner_calculation_finish(&env, &m->error, &m->delta);
+		miner_calculation_finish(&env, &m->error, &delta);
+		miner_set_delta(m, delta);
 		consider_updating(m, 0, auto_restart);
 	}
-	return stralloc("");
+	return reload_warnings(unloaded, invalid);
 }
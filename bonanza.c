@@ -19,6 +19,7 @@
 #include "var.h"
 #include "host.h"
 #include "map.h"
+#include "preload.h"
 #include "expr.h"
 #include "exec.h"
 #include "fds.h"
@@ -28,6 +29,7 @@
 #include "exec.h"
 #include "miner.h"
 #include "api.h"
+#include "testall.h"
 
 #include "y.tab.h"
 
@@ -44,7 +46,11 @@ static void usage(const char *name)
 {
 	fprintf(stderr,
 "usage: %s [-d] [-g address] [-j off|port] [-m host:[port]] [-p port]\n"
-"       %*s[-r] [-u] [-v ...] [-Y] [rules__file]\n\n"
+"       %*s[-r] [-u] [-v ...] [-Y] [-B bytes] [-S steps] [-T ms]\n"
+"       %*s[rules__file]\n\n"
+"-B bytes, --max-bytes=bytes\n"
+"\tmaximum number of string bytes a single execution of the rules may\n"
+"\tallocate. 0 for no limit. Default: %u\n"
 "-d, --dump\n"
 "\tdon't enter daemon mode, run rules once, dump all data\n"
 "-g address, --group=address\n"
@@ -67,15 +73,22 @@ static void usage(const char *name)
 "\tare made.\n"
 "-r, --restart\n"
 "\tautomatically restart miner if configuration update requires it\n"
+"-S steps, --max-steps=steps\n"
+"\tmaximum number of evaluation steps in a single execution of the rules.\n"
+"\t0 for no limit. Default: %u\n"
+"-T ms, --max-time=ms\n"
+"\tmaximum time a single execution of the rules may take, in milliseconds.\n"
+"\t0 for no limit. Default: %u\n"
 "-u, --update\n"
 "\tautomatically perform configuration updates\n"
 "-v, --verbose\n"
 "\tverbose operation. Repeating increases verbosity.\n"
 "-Y, --yydebug\n"
 "\tenable yydebug (for debugging of lsterm only)\n"
-	    , name, (int) strlen(name) + 1, "",
+	    , name, (int) strlen(name) + 1, "", (int) strlen(name) + 1, "",
+	    DEFAULT_MAX_BYTES,
 	    DEFAULT_MC_ADDR, DEFAULT_HTTP_PORT, DEFAULT_CREW_PORT,
-	    MQTT_DEFAULT_PORT);
+	    MQTT_DEFAULT_PORT, DEFAULT_MAX_STEPS, DEFAULT_MAX_TIME_MS);
 	exit(1);
 }
 
@@ -88,7 +101,7 @@ int main(int argc, char **argv)
 	const char *crew_mc_addr = NULL;
 	const char *broker = NULL;
 	bool dump = 0;
-	char *end;
+	char *end, *unloaded;
 	int longopt = 0;
 	int c;
 
@@ -96,6 +109,9 @@ int main(int argc, char **argv)
 		{ "dump",	0,	&longopt,	'd' },
 		{ "group",	1,	&longopt,	'g' },
 		{ "magic",	1,	&longopt,	'm' },
+		{ "max-bytes",	1,	&longopt,	'B' },
+		{ "max-steps",	1,	&longopt,	'S' },
+		{ "max-time",	1,	&longopt,	'T' },
 		{ "port",	1,	&longopt,	'p' },
 		{ "restart",	0,	&longopt,	'r' },
 		{ "update",	0,	&longopt,	'u' },
@@ -104,9 +120,14 @@ int main(int argc, char **argv)
 		{ NULL,		0,	NULL,		0 }
 	};
 
-	while ((c = getopt_long(argc, argv, "dg:M:m:p:r:uvY", longopts,
+	while ((c = getopt_long(argc, argv, "B:dg:M:m:p:r:S:T:uvY", longopts,
 	    NULL)) != EOF)
 		switch (c ? c : longopt) {
+		case 'B':
+			max_bytes = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
 		case 'd':
 			dump = 1;
 			break;
@@ -136,6 +157,16 @@ int main(int argc, char **argv)
 		case 'r':
 			auto_restart = 1;
 			break;
+		case 'S':
+			max_steps = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'T':
+			max_time_ms = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
 		case 'u':
 			auto_update = 1;
 			break;
@@ -152,6 +183,13 @@ int main(int argc, char **argv)
 	switch (argc - optind) {
 	case 1:
 		rules = rules_file(argv[optind]);
+		unloaded = preload_files(rules, dump ? NULL : ACTIVE_DIR);
+		if (unloaded) {
+			fprintf(stderr,
+			    "warning: some files could not be loaded:\n%s\n",
+			    unloaded);
+			free(unloaded);
+		}
 		break;
 	case 0:
 		break;
@@ -197,6 +235,7 @@ int main(int argc, char **argv)
 		mqtt_idle();
 	}
 
+	test_all_cleanup();
 	miner_destroy_all();
 	free_rules(rules);
 	free_host_files();
@@ -13,6 +13,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
 
 
 #define	IPv4_QUAD_FMT	"%u.%u.%u.%u"
@@ -34,9 +35,13 @@ extern struct rule *active_rules;
 extern const char *magic;
 extern unsigned verbose;
 
+/*
+ * The lexer and the parser are not reentrant. Anyone using them must hold
+ * parser_lock.
+ */
+extern pthread_mutex_t parser_lock;
+
 
 void scan_rules(FILE *file, const char *name);
-void scan_hosts(FILE *file, const char *name);
-void scan_map(FILE *file, const char *name);
 
 #endif /* !BONANZA_H */
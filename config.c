@@ -18,17 +18,72 @@
 #include "alloc.h"
 #include "expr.h"
 #include "hash.h"
+#include "intern.h"
 #include "config.h"
 
 
+static void free_index(struct config *c)
+{
+	free(c->index);
+	c->index = NULL;
+	c->elems = NULL;
+}
+
+
 /* ----- Variable setting (from MQTT) -------------------------------------- */
 
 
-bool config_set(struct config *c, const char *name, const char *value)
+static void var_fingerprint(struct fingerprint *fp, const char *name,
+    const char *value)
+{
+	struct hash_ctx ctx;
+
+	hash_init(&ctx);
+	hash_update(&ctx, name, intern_len(name));
+	hash_update(&ctx, "=", 1);
+	hash_update(&ctx, value, intern_len(value));
+	hash_final(&ctx, fp);
+}
+
+
+static void add_var(struct config *c, const struct cfgvar *cv)
+{
+	struct fingerprint fp;
+
+	var_fingerprint(&fp, cv->name, cv->value);
+	fingerprint_add(&c->fp, &fp);
+}
+
+
+static void remove_var(struct config *c, const struct cfgvar *cv)
+{
+	struct fingerprint fp;
+
+	var_fingerprint(&fp, cv->name, cv->value);
+	fingerprint_sub(&c->fp, &fp);
+}
+
+
+/* "value" must be interned */
+
+static void set_value(struct cfgvar *cv, const char *value)
 {
+	cv->value = value;
+	cv->v.num = 0;
+	cv->v.s = (char *) value;	/* the rules don't change it */
+	cv->v.n = 0;
+}
+
+
+bool config_set(struct config **config, const char *name,
+    const char *value)
+{
+	struct config *c;
 	struct cfgvar **anchor;
 	struct cfgvar *cv;
 
+	*config = config_unshare(*config);
+	c = *config;
 	for (anchor = &c->vars; *anchor; anchor = &(*anchor)->next) {
 		int cmp;
 
@@ -37,13 +92,16 @@ bool config_set(struct config *c, const char *name, const char *value)
 		if (!cmp) {
 			if (!strcmp(cv->value, value))
 				return 0;
-			free(cv->value);
+			remove_var(c, cv);
+			intern_put(cv->value);
 			if (*value) {
-				cv->value = stralloc(value);
+				set_value(cv, intern(value));
+				add_var(c, cv);
 			} else {
 				*anchor = cv->next;
-				free(cv->name);
+				intern_put(cv->name);
 				free(cv);
+				free_index(c);
 			}
 			return 1;
 		}
@@ -53,42 +111,94 @@ bool config_set(struct config *c, const char *name, const char *value)
 	if (!*value)
 		return 0;
 	cv = alloc_type(struct cfgvar);
-	cv->name = stralloc(name);
-	cv->value = stralloc(value);
+	cv->name = intern(name);
+	set_value(cv, intern(value));
 	cv->keys = !strcmp(name, "DEST");
+	cv->elem = !strncmp(name, "DEST_", 5);
 	cv->next = *anchor;
 	*anchor = cv;
+	add_var(c, cv);
+	free_index(c);
 	return 1;
 }
 
 
+/* ----- Lookup ------------------------------------------------------------ */
+
+
+static void build_index(struct config *c)
+{
+	struct cfgvar *cv;
+	unsigned n = 0, mask = 15;
+	unsigned i;
+
+	for (cv = c->vars; cv; cv = cv->next) {
+		n++;
+		if (cv->elem && !c->elems)
+			c->elems = cv;
+	}
+	while (mask < 2 * n)
+		mask = mask << 1 | 1;
+	c->index_size = mask + 1;
+	c->index = alloc_type_n(struct cfgvar *, c->index_size);
+	memset(c->index, 0, sizeof(struct cfgvar *) * c->index_size);
+	for (cv = c->vars; cv; cv = cv->next) {
+		for (i = intern_hash(cv->name) & mask; c->index[i];
+		    i = (i + 1) & mask)
+			;
+		c->index[i] = cv;
+	}
+}
+
+
+const struct cfgvar *config_get(struct config *c, const char *name)
+{
+	const struct cfgvar *cv;
+	unsigned mask, i;
+
+	if (!c->index)
+		build_index(c);
+	mask = c->index_size - 1;
+	for (i = hash_str_nocase(name) & mask; (cv = c->index[i]);
+	    i = (i + 1) & mask)
+		if (!strcmp(cv->name, name))
+			return cv;
+	return NULL;
+}
+
+
+const struct cfgvar *config_elems(struct config *c)
+{
+	if (!c->index)
+		build_index(c);
+	return c->elems;
+}
+
+
 /* ----- Differences ------------------------------------------------------- */
 
 
 struct json_object *change_to_json(const struct delta *d)
 {
 	struct json_object *obj = json_object_new_object();
+	const struct change *ch;
 
 	if (!obj) {
 		perror("json_object_new_object");
 		return NULL;
 	}
-	for (; d; d = d->next) {
+	for (ch = d->changes; ch != d->changes + d->n; ch++) {
 		struct json_object *value = NULL;
 
-		if (!d->old && !d->new)
-			continue;
-		if (d->old && d->new && !strcmp(d->old, d->new))
-			continue;
-		if (d->new) {
-			value = json_object_new_string(d->new);
+		if (ch->new) {
+			value = json_object_new_string(ch->new);
 			if (!value) {
 				perror("json_object_new_string");
 				json_object_put(obj);
 				return NULL;
 			}
 		}
-		if (json_object_object_add(obj, d->name, value) < 0) {
+		if (json_object_object_add(obj, ch->name, value) < 0) {
 			perror("json_object_object_add");
 			json_object_put(obj);
 			return NULL;
@@ -116,14 +226,16 @@ static json_object *json_object_string_or_null(const char *s)
 struct json_object *delta_to_json(const struct delta *d)
 {
 	json_object *obj = json_object_new_array();
+	struct delta_iter it;
 
 	if (!obj) {
 		perror("json_object_new_object");
 		exit(1);
 	}
-	while (d) {
-		json_object *old = json_object_string_or_null(d->old);
-		json_object *new = json_object_string_or_null(d->new);
+	delta_iter_init(&it, d);
+	while (delta_next(&it)) {
+		json_object *old = json_object_string_or_null(it.old);
+		json_object *new = json_object_string_or_null(it.new);
 		json_object *entry = json_object_new_object();
 		json_object *name;
 
@@ -132,7 +244,7 @@ struct json_object *delta_to_json(const struct delta *d)
 			exit(1);
 		}
 
-		name = json_object_new_string(d->name);
+		name = json_object_new_string(it.name);
 		if (!name) {
 			perror("json_object_new_string");
 			exit(1);
@@ -147,119 +259,161 @@ struct json_object *delta_to_json(const struct delta *d)
 			perror("json_object_array_add");
 			exit(1);
 		}
-		d = d->next;
 	}
 	return obj;
 }
 
 
-bool delta_same(struct delta *d)
+void delta_iter_init(struct delta_iter *it, const struct delta *d)
 {
-	while (d) {
-		if (strcmp(d->old ? d->old : "", d->new ? d->new : ""))
-			return 0;
-		d = d->next;
+	it->delta = d;
+	it->cv = d ? d->config->vars : NULL;
+	it->i = 0;
+}
+
+
+bool delta_next(struct delta_iter *it)
+{
+	const struct delta *d = it->delta;
+	const struct change *ch = NULL;
+	int cmp;
+
+	if (d && it->i != d->n)
+		ch = d->changes + it->i;
+
+	if (!it->cv && !ch)
+		return 0;
+	cmp = !ch ? -1 : !it->cv ? 1 : strcmp(it->cv->name, ch->name);
+	if (cmp < 0) {
+		it->name = it->cv->name;
+		it->old = it->new = it->cv->value;
+		it->cv = it->cv->next;
+		return 1;
 	}
+	if (!cmp)
+		it->cv = it->cv->next;
+	it->name = ch->name;
+	it->old = ch->old;
+	it->new = ch->new;
+	it->i++;
 	return 1;
 }
 
 
-static void delta_add(struct delta ***anchor, const char *name,
+bool delta_same(const struct delta *d)
+{
+	return !d || !d->n;
+}
+
+
+static void add_change(struct delta *d, unsigned *size, const char *name,
     const char *old, const char *new)
 {
-	struct delta *d;
+	struct hash_ctx ctx;
+	struct fingerprint fp;
+	struct change *ch;
 
-	if ((!old || !*old) && (!new || !*new))
+	if (!strcmp(old ? old : "", new ? new : ""))
 		return;
-	d = alloc_type(struct delta);
-	d->name = stralloc(name);
-	d->old = old && *old ? stralloc(old) : NULL;
-	d->new = new && *new ? stralloc(new) : NULL;
-	d->next = NULL;
-	**anchor = d;
-	*anchor = &d->next;
+	if (d->n == *size) {
+		*size = *size ? *size * 2 : 8;
+		d->changes = realloc_type_n(d->changes, *size);
+	}
+	ch = d->changes + d->n++;
+	ch->name = intern(name);
+	ch->old = old;
+	ch->new = new && *new ? stralloc(new) : NULL;
+
+	hash_init(&ctx);
+	hash_update(&ctx, ch->name, intern_len(ch->name));
+	hash_update(&ctx, "=", 1);
+	if (ch->old)
+		hash_update(&ctx, ch->old, strlen(ch->old));
+	hash_update(&ctx, "\n", 1);
+	if (ch->new)
+		hash_update(&ctx, ch->new, strlen(ch->new));
+	hash_final(&ctx, &fp);
+	fingerprint_add(&d->fp, &fp);
 }
 
 
+/*
+ * "v" only has the variables the rules have set, and the elements of DEST.
+ * Variables in the configuration that are not in "v" are therefore unchanged,
+ * except for DEST (which finalize_vars sets if there are any keys) and its
+ * elements, which have been removed (with DEST = {}) if they're not in "v".
+ *
+ * If there are no variables at all, config_delta returns NULL.
+ */
+
 struct delta *config_delta(struct config *c, const struct var *v)
 {
-	struct cfgvar *cv = c->vars;
-	struct delta *d = NULL;
-	struct delta **anchor = &d;
+	const struct cfgvar *cv = c->vars;
+	struct delta *d;
+	unsigned size = 0;
 
+	d = alloc_type(struct delta);
+	d->config = c;
+	d->changes = NULL;
+	d->n = 0;
+	d->fp.lo = d->fp.hi = 0;
 	while (cv || v) {
-		int cmp;
+		int cmp = 0;
 
-		while (cv && cv->keys && strcmp(cv->name, "DEST"))
-			cv = cv->next;
 		if (cv && v)
 			cmp = strcmp(cv->name, v->name);
 		if (!cv || cmp > 0) {
-			delta_add(&anchor, v->name, NULL, v->value->s);
+			add_change(d, &size, v->name, NULL, v->value->s);
 			v = v->next;
 		} else if (!v || cmp < 0) {
-			delta_add(&anchor, cv->name, cv->value, NULL);
+			if (cv->keys || cv->elem)
+				add_change(d, &size, cv->name, cv->value,
+				    NULL);
 			cv = cv->next;
 		} else {
-			delta_add(&anchor, cv->name, cv->value, v->value->s);
+			add_change(d, &size, cv->name, cv->value,
+			    v->value->s);
 			v = v->next;
 			cv = cv->next;
 		}
 	}
+	if (!d->n && !c->vars) {
+		free(d);
+		return NULL;
+	}
 	return d;
 }
 
 
 void config_free_delta(struct delta *d)
 {
-	struct delta *next;
+	struct change *ch;
 
-	while (d) {
-		next = d->next;
-		free(d->name);
-		free(d->old);
-		free(d->new);
-		free(d);
-		d = next;
+	if (!d)
+		return;
+	for (ch = d->changes; ch != d->changes + d->n; ch++) {
+		intern_put(ch->name);
+		free(ch->new);
 	}
+	free(d->changes);
+	free(d);
 }
 
 
 /* ----- Hashes ------------------------------------------------------------ */
 
 
-char *config_hash(struct config *c)
+char *config_hash(const struct config *c)
 {
-	const struct cfgvar *cv;
-
-	hash_begin();
-	for (cv = c->vars; cv; cv = cv->next) {
-		hash_add(cv->name, strlen(cv->name));
-		hash_add("=", 1);
-		hash_add(cv->value, strlen(cv->value));
-		hash_add("\n", 1);
-	}
-	return hash_end();
+	return fingerprint_string(&c->fp);
 }
 
 
-char *config_hash_delta(struct delta *d)
+char *config_hash_delta(const struct delta *d)
 {
-	hash_begin();
-	while (d) {
-		if (strcmp(d->old ? d->old : "", d->new ? d->new : "")) {
-			hash_add(d->name, strlen(d->name));
-			hash_add("=", 1);
-			if (d->old)
-				hash_add(d->old, strlen(d->old));
-			hash_add("\n", 1);
-			if (d->new)
-				hash_add(d->new, strlen(d->new));
-			hash_add("\n", 1);
-		}
-		d = d->next;
-	}
-	return hash_end();
+	static const struct fingerprint none = { 0, 0 };
+
+	return fingerprint_string(d ? &d->fp : &none);
 }
 
 
@@ -268,38 +422,193 @@ char *config_hash_delta(struct delta *d)
 
 void dump_delta(const struct delta *d)
 {
+	struct delta_iter it;
+
 	printf("----- Delta -----\n");
-	while (d) {
-		const char *old = d->old ? d->old : "";
-		const char *new = d->new ? d->new : "";
+	delta_iter_init(&it, d);
+	while (delta_next(&it)) {
+		const char *old = it.old ? it.old : "";
+		const char *new = it.new ? it.new : "";
 
 		if (!strcmp(old, new))
-			printf(" %s=%s\n", d->name, old);
+			printf(" %s=%s\n", it.name, old);
 		else if (*old)
-			printf("-%s=%s\n", d->name, old);
+			printf("-%s=%s\n", it.name, old);
 		else if (*new)
-			printf("+%s=%s\n", d->name, new);
-		d = d->next;
+			printf("+%s=%s\n", it.name, new);
 	}
 	printf("-----\n");
 }
 
 
+/* ----- Sharing ----------------------------------------------------------- */
+
+
+/*
+ * Miners often have identical configurations. Shared configurations are kept
+ * in a hash table, by content, and are reference-counted. They are not
+ * changed while they're shared; config_set makes a copy first.
+ */
+
+#define	INITIAL_SHARED_BUCKETS	64
+
+
+static struct config **shared = NULL;
+static unsigned n_shared_buckets = 0;
+static unsigned n_shared = 0;
+
+
+static uint32_t content_hash(const struct config *c)
+{
+	return c->fp.lo ^ c->fp.lo >> 32;
+}
+
+
+static bool same_content(const struct config *a, const struct config *b)
+{
+	const struct cfgvar *va = a->vars;
+	const struct cfgvar *vb = b->vars;
+
+	while (va && vb) {
+		if (va->name != vb->name || va->value != vb->value)
+			return 0;
+		va = va->next;
+		vb = vb->next;
+	}
+	return !va && !vb;
+}
+
+
+static struct config **shared_bucket(uint32_t hash)
+{
+	return shared + (hash & (n_shared_buckets - 1));
+}
+
+
+static void grow_shared(void)
+{
+	struct config **old = shared;
+	unsigned n_old = n_shared_buckets;
+	struct config *c, *next, **b;
+	unsigned i;
+
+	n_shared_buckets = n_old ? n_old * 2 : INITIAL_SHARED_BUCKETS;
+	shared = alloc_type_n(struct config *, n_shared_buckets);
+	memset(shared, 0, sizeof(struct config *) * n_shared_buckets);
+	for (i = 0; i != n_old; i++)
+		for (c = old[i]; c; c = next) {
+			next = c->chain;
+			b = shared_bucket(c->hash);
+			c->chain = *b;
+			*b = c;
+		}
+	free(old);
+}
+
+
+static void unlink_shared(struct config *c)
+{
+	struct config **anchor;
+
+	for (anchor = shared_bucket(c->hash); *anchor != c;
+	    anchor = &(*anchor)->chain)
+		;
+	*anchor = c->chain;
+	c->shared = 0;
+	n_shared--;
+}
+
+
+struct config *config_share(struct config *c)
+{
+	struct config *s, **b;
+	uint32_t hash;
+
+	if (c->shared)
+		return c;
+	/* config_get and config_elems must not change shared configurations */
+	if (!c->index)
+		build_index(c);
+	hash = content_hash(c);
+	if (n_shared_buckets)
+		for (s = *shared_bucket(hash); s; s = s->chain)
+			if (s->hash == hash && same_content(s, c)) {
+				s->refs++;
+				config_free(c);
+				return s;
+			}
+	if (n_shared == n_shared_buckets)
+		grow_shared();
+	c->hash = hash;
+	c->refs = 1;
+	c->shared = 1;
+	b = shared_bucket(hash);
+	c->chain = *b;
+	*b = c;
+	n_shared++;
+	return c;
+}
+
+
+struct config *config_ref(struct config *c)
+{
+	if (!c->shared)
+		return config_copy(c);
+	c->refs++;
+	return c;
+}
+
+
+struct config *config_unshare(struct config *c)
+{
+	if (!c->shared)
+		return c;
+	if (c->refs == 1) {
+		unlink_shared(c);
+		return c;
+	}
+	c->refs--;
+	return config_copy(c);
+}
+
+
 /* ----- Construction and restart ------------------------------------------ */
 
 
-void config_reset(struct config *c)
+static void config_reset(struct config *c)
 {
-	if (!c)
-		return;
 	while (c->vars) {
 		struct cfgvar *cv = c->vars;
 
 		c->vars = cv->next;
-		free(cv->name);
-		free(cv->value);
+		intern_put(cv->name);
+		intern_put(cv->value);
 		free(cv);
 	}
+	c->fp.lo = c->fp.hi = 0;
+	free_index(c);
+}
+
+
+struct config *config_copy(const struct config *c)
+{
+	struct config *new = config_new();
+	struct cfgvar **anchor = &new->vars;
+	const struct cfgvar *cv;
+
+	for (cv = c->vars; cv; cv = cv->next) {
+		struct cfgvar *copy = alloc_type(struct cfgvar);
+
+		copy->name = intern_ref(cv->name);
+		set_value(copy, intern_ref(cv->value));
+		copy->keys = cv->keys;
+		copy->elem = cv->elem;
+		copy->next = NULL;
+		*anchor = copy;
+		anchor = &copy->next;
+	}
+	new->fp = c->fp;
+	return new;
 }
 
 
@@ -309,12 +618,23 @@ struct config *config_new(void)
 
 	c = alloc_type(struct config);
 	c->vars = NULL;
+	c->index = NULL;
+	c->elems = NULL;
+	c->shared = 0;
+	c->fp.lo = c->fp.hi = 0;
 	return c;
 }
 
 
 void config_free(struct config *c)
 {
+	if (!c)
+		return;
+	if (c->shared) {
+		if (--c->refs)
+			return;
+		unlink_shared(c);
+	}
 	config_reset(c);
 	free(c);
 }
@@ -11,33 +11,89 @@
 #define	CONFIG_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <json-c/json.h>
 
+#include "hash.h"
+#include "expr.h"
 #include "var.h"
 
 
 struct cfgvar {
-	char *name;
-	char *value;
+	const char *name;	/* interned */
+	const char *value;	/* interned */
+	struct value v;		/* "value", as seen by the rules */
 	bool keys;		/* variable contains keys of associative
 				   array */
+	bool elem;		/* variable is element of associative array */
 	struct cfgvar *next;
 };
 
 struct config {
-	struct cfgvar *vars;
+	struct cfgvar *vars;	/* sorted by name */
+	struct cfgvar **index;	/* by name, built on demand; NULL if none */
+	unsigned index_size;	/* power of two */
+	struct cfgvar *elems;	/* first element of DEST */
+	struct fingerprint fp;	/* of all the "name=value" */
+	bool shared;		/* in the table of shared configurations */
+	unsigned refs;		/* references, if shared */
+	uint32_t hash;		/* content hash, if shared */
+	struct config *chain;	/* next in hash bucket, if shared */
 };
 
-struct delta {
-	char *name;
-	char *old;		/* NULL if unset */
+struct change {
+	const char *name;	/* interned */
+	const char *old;	/* NULL if unset; in the configuration */
 	char *new;		/* NULL if unset or deleted */
-	struct delta *next;
 };
 
+/*
+ * A delta only stores the variables that change, sorted by name. Variables
+ * that stay the same are found in the configuration the delta was calculated
+ * for, which must therefore not be changed or freed while the delta exists.
+ */
+
+struct delta {
+	const struct config *config;
+	struct change *changes;
+	unsigned n;		/* number of changes */
+	struct fingerprint fp;	/* of the changes */
+};
+
+/*
+ * delta_next iterates over all the variables of the configuration and the
+ * delta, in the order of their names, and whether they change or not. It
+ * returns 0 at the end.
+ */
+
+struct delta_iter {
+	const struct delta *delta;
+	const struct cfgvar *cv;	/* next variable of the configuration */
+	unsigned i;			/* next change */
+	const char *name;
+	const char *old;		/* NULL if unset */
+	const char *new;		/* NULL if unset or deleted */
+};
+
+
+/*
+ * config_set makes a copy of the configuration if it is shared, and updates
+ * the pointer.
+ */
+
+bool config_set(struct config **config, const char *name,
+    const char *value);
 
-bool config_set(struct config *c, const char *name, const char *value);
+/*
+ * config_get returns the variable with the specified name, NULL if there is
+ * none. config_elems returns the first element of the associative array DEST
+ * (variables named DEST_key), NULL if there is none. The elements follow each
+ * other in "vars".
+ */
+
+const struct cfgvar *config_get(struct config *c, const char *name);
+const struct cfgvar *config_elems(struct config *c);
 
 /*
  * change_to_json has only the set commands. delta_to_json has old and new
@@ -46,17 +102,41 @@ bool config_set(struct config *c, const char *name, const char *value);
 struct json_object *change_to_json(const struct delta *d);
 struct json_object *delta_to_json(const struct delta *d);
 
-bool delta_same(struct delta *d);
+void delta_iter_init(struct delta_iter *it, const struct delta *d);
+bool delta_next(struct delta_iter *it);
+
+bool delta_same(const struct delta *d);
 
 struct delta *config_delta(struct config *c, const struct var *v);
 void config_free_delta(struct delta *d);
 
-char *config_hash(struct config *c);
-char *config_hash_delta(struct delta *d);
+/*
+ * The hashes are fingerprints (see hash.h), which config_set and
+ * config_delta maintain as they go.
+ */
+
+char *config_hash(const struct config *c);
+char *config_hash_delta(const struct delta *d);
 
 void dump_delta(const struct delta *d);
 
-void config_reset(struct config *c);
+/*
+ * config_share returns a shared configuration with the same content as "c",
+ * and takes ownership of "c". If there is no such configuration yet, "c"
+ * becomes shared. config_unshare returns a configuration that can be changed,
+ * either "c" or a copy of it, and takes ownership of "c". config_ref returns a
+ * new reference to a shared configuration, or a copy of an unshared one.
+ * config_free drops a reference to a shared configuration.
+ *
+ * Shared configurations don't change, and can be read from any thread.
+ * Reference counting is only done on the main thread.
+ */
+
+struct config *config_share(struct config *c);
+struct config *config_unshare(struct config *c);
+struct config *config_ref(struct config *c);
+
+struct config *config_copy(const struct config *c);
 struct config *config_new(void);
 void config_free(struct config *c);
 
@@ -0,0 +1,475 @@
+/*
+ * cse.c - Common subexpression elimination
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * Rules often repeat the same subexpression, e.g., a map lookup or a host
+ * file test in several conditions, or a common prefix in many assignments.
+ * After parsing, we look for structurally identical subtrees and give all of
+ * them the same cache slot. When evaluating, the first occurrence stores its
+ * result in the slot, and the others just use it.
+ *
+ * A cached result becomes invalid when a variable it reads is assigned. For
+ * this, each setting has a list of the slots that depend on the variable it
+ * assigns.
+ *
+ * Constants and plain variable reads are not worth caching.
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "hash.h"
+#include "expr.h"
+#include "exec.h"
+#include "cse.h"
+
+
+struct node {
+	bool is_bool;
+	union {
+		struct expr *expr;
+		struct bool_expr *bool_expr;
+	} u;
+	uint32_t hash;
+	struct node *next;	/* in hash bucket */
+};
+
+struct dep {
+	unsigned slot;
+	bool cfg;
+	const char *name;
+	struct dep *next;
+};
+
+struct cse_ctx {
+	struct node **buckets;
+	unsigned n_buckets;
+	unsigned slots;		/* last slot assigned */
+	struct dep *deps;
+};
+
+
+/* ----- Structural hash --------------------------------------------------- */
+
+
+static uint32_t mix_ptr(uint32_t h, const void *p)
+{
+	uintptr_t v = (uintptr_t) p;
+
+	h = fnv_mix(h, v);
+	return fnv_mix(h, (uint64_t) v >> 32);
+}
+
+
+static uint32_t mix_str(uint32_t h, const char *s)
+{
+	return fnv_mix(hash_str_continue(h, s), 0);
+}
+
+
+static uint32_t hash_expr(const struct expr *e);
+
+
+static uint32_t hash_opt_expr(uint32_t h, const struct expr *e)
+{
+	return e ? fnv_mix(h, hash_expr(e)) : fnv_mix(h, 0);
+}
+
+
+static uint32_t hash_expr(const struct expr *e)
+{
+	struct value *(*op)(const struct expr *self,
+	    const struct exec_env *exec) = e->op;
+	uint32_t h = mix_ptr(FNV_OFFSET, op);
+	unsigned i;
+
+	if (op == op_string) {
+		h = mix_str(h, e->a.s);
+	} else if (op == op_num) {
+		h = mix_str(h, e->a.s);
+		h = fnv_mix(h, e->b.n);
+	} else if (op == op_cfg || op == op_var) {
+		h = mix_str(h, e->a.s);
+		h = hash_opt_expr(h, e->key);
+	} else if (op == op_concat) {
+		for (i = 0; i != e->b.n; i++)
+			h = fnv_mix(h, hash_expr(e->a.exprs[i]));
+	} else if (op == op_map) {
+		h = mix_str(h, e->a.s);
+		h = fnv_mix(h, hash_expr(e->b.expr));
+	} else {
+		abort();
+	}
+	return h;
+}
+
+
+static uint32_t hash_bool_expr(const struct bool_expr *e)
+{
+	bool (*op)(const struct bool_expr *self, const struct exec_env *exec) =
+	    e->op;
+	uint32_t h = mix_ptr(FNV_OFFSET, op);
+	const struct list *l;
+
+	if (op == op_or || op == op_and) {
+		h = fnv_mix(h, hash_bool_expr(e->a.bool_expr));
+		h = fnv_mix(h, hash_bool_expr(e->b.bool_expr));
+	} else if (op == op_not) {
+		h = fnv_mix(h, hash_bool_expr(e->a.bool_expr));
+	} else if (is_relop(op)) {
+		h = fnv_mix(h, hash_expr(e->a.expr));
+		h = fnv_mix(h, hash_expr(e->b.expr));
+	} else if (op == op_bool) {
+		h = fnv_mix(h, hash_expr(e->a.expr));
+	} else if (op == op_in_file) {
+		h = fnv_mix(h, hash_expr(e->a.expr));
+		h = mix_str(h, e->b.s);
+	} else if (op == op_in_list) {
+		h = fnv_mix(h, hash_expr(e->a.expr));
+		for (l = e->b.list; l; l = l->next)
+			h = fnv_mix(h, hash_expr(l->expr));
+	} else {
+		abort();
+	}
+	return h;
+}
+
+
+/* ----- Structural equality ----------------------------------------------- */
+
+
+static bool same_expr(const struct expr *a, const struct expr *b);
+
+
+static bool same_opt_expr(const struct expr *a, const struct expr *b)
+{
+	if (!a || !b)
+		return a == b;
+	return same_expr(a, b);
+}
+
+
+static bool same_expr(const struct expr *a, const struct expr *b)
+{
+	struct value *(*op)(const struct expr *self,
+	    const struct exec_env *exec) = a->op;
+	unsigned i;
+
+	if (a->op != b->op)
+		return 0;
+	if (op == op_string)
+		return !strcmp(a->a.s, b->a.s);
+	if (op == op_num)
+		return a->b.n == b->b.n && !strcmp(a->a.s, b->a.s);
+	if (op == op_cfg || op == op_var)
+		return !strcmp(a->a.s, b->a.s) && same_opt_expr(a->key, b->key);
+	if (op == op_concat) {
+		if (a->b.n != b->b.n)
+			return 0;
+		for (i = 0; i != a->b.n; i++)
+			if (!same_expr(a->a.exprs[i], b->a.exprs[i]))
+				return 0;
+		return 1;
+	}
+	if (op == op_map)
+		return !strcmp(a->a.s, b->a.s) &&
+		    same_expr(a->b.expr, b->b.expr);
+	abort();
+}
+
+
+static bool same_bool_expr(const struct bool_expr *a,
+    const struct bool_expr *b)
+{
+	bool (*op)(const struct bool_expr *self, const struct exec_env *exec) =
+	    a->op;
+	const struct list *la, *lb;
+
+	if (a->op != b->op)
+		return 0;
+	if (op == op_or || op == op_and)
+		return same_bool_expr(a->a.bool_expr, b->a.bool_expr) &&
+		    same_bool_expr(a->b.bool_expr, b->b.bool_expr);
+	if (op == op_not)
+		return same_bool_expr(a->a.bool_expr, b->a.bool_expr);
+	if (is_relop(op))
+		return same_expr(a->a.expr, b->a.expr) &&
+		    same_expr(a->b.expr, b->b.expr);
+	if (op == op_bool)
+		return same_expr(a->a.expr, b->a.expr);
+	if (op == op_in_file)
+		return same_expr(a->a.expr, b->a.expr) &&
+		    !strcmp(a->b.s, b->b.s);
+	if (op == op_in_list) {
+		if (!same_expr(a->a.expr, b->a.expr))
+			return 0;
+		la = a->b.list;
+		lb = b->b.list;
+		while (la && lb) {
+			if (!same_expr(la->expr, lb->expr))
+				return 0;
+			la = la->next;
+			lb = lb->next;
+		}
+		return !la && !lb;
+	}
+	abort();
+}
+
+
+/* ----- Dependencies ------------------------------------------------------ */
+
+
+static void add_dep(struct cse_ctx *ctx, unsigned slot, bool cfg,
+    const char *name)
+{
+	struct dep *d;
+
+	for (d = ctx->deps; d; d = d->next)
+		if (d->slot == slot && d->cfg == cfg && !strcmp(d->name, name))
+			return;
+	d = alloc_type(struct dep);
+	d->slot = slot;
+	d->cfg = cfg;
+	d->name = name;
+	d->next = ctx->deps;
+	ctx->deps = d;
+}
+
+
+static void expr_deps(struct cse_ctx *ctx, unsigned slot,
+    const struct expr *e)
+{
+	struct value *(*op)(const struct expr *self,
+	    const struct exec_env *exec) = e->op;
+	unsigned i;
+
+	if (op == op_cfg || op == op_var) {
+		add_dep(ctx, slot, op == op_cfg, e->a.s);
+		if (e->key)
+			expr_deps(ctx, slot, e->key);
+	} else if (op == op_concat) {
+		for (i = 0; i != e->b.n; i++)
+			expr_deps(ctx, slot, e->a.exprs[i]);
+	} else if (op == op_map) {
+		expr_deps(ctx, slot, e->b.expr);
+	}
+}
+
+
+static void bool_expr_deps(struct cse_ctx *ctx, unsigned slot,
+    const struct bool_expr *e)
+{
+	bool (*op)(const struct bool_expr *self, const struct exec_env *exec) =
+	    e->op;
+	const struct list *l;
+
+	if (op == op_or || op == op_and) {
+		bool_expr_deps(ctx, slot, e->a.bool_expr);
+		bool_expr_deps(ctx, slot, e->b.bool_expr);
+	} else if (op == op_not) {
+		bool_expr_deps(ctx, slot, e->a.bool_expr);
+	} else if (is_relop(op)) {
+		expr_deps(ctx, slot, e->a.expr);
+		expr_deps(ctx, slot, e->b.expr);
+	} else if (op == op_in_list) {
+		expr_deps(ctx, slot, e->a.expr);
+		for (l = e->b.list; l; l = l->next)
+			expr_deps(ctx, slot, l->expr);
+	} else {
+		expr_deps(ctx, slot, e->a.expr);
+	}
+}
+
+
+/* ----- Finding common subexpressions ------------------------------------- */
+
+
+static void add_node(struct cse_ctx *ctx, struct node *n)
+{
+	struct node **anchor = ctx->buckets + n->hash % ctx->n_buckets;
+	struct node *other;
+	unsigned slot;
+
+	for (other = *anchor; other; other = other->next) {
+		if (other->hash != n->hash || other->is_bool != n->is_bool)
+			continue;
+		if (n->is_bool ?
+		    same_bool_expr(other->u.bool_expr, n->u.bool_expr) :
+		    same_expr(other->u.expr, n->u.expr))
+			break;
+	}
+	if (!other) {
+		n->next = *anchor;
+		*anchor = n;
+		return;
+	}
+
+	if (other->is_bool) {
+		slot = other->u.bool_expr->cse;
+		if (!slot) {
+			slot = other->u.bool_expr->cse = ++ctx->slots;
+			bool_expr_deps(ctx, slot, other->u.bool_expr);
+		}
+		n->u.bool_expr->cse = slot;
+	} else {
+		slot = other->u.expr->cse;
+		if (!slot) {
+			slot = other->u.expr->cse = ++ctx->slots;
+			expr_deps(ctx, slot, other->u.expr);
+		}
+		n->u.expr->cse = slot;
+	}
+	free(n);
+}
+
+
+static void visit_expr(struct expr *e, void *user)
+{
+	struct node *n;
+
+	if (e->op != op_concat && e->op != op_map)
+		return;
+	n = alloc_type(struct node);
+	n->is_bool = 0;
+	n->u.expr = e;
+	n->hash = hash_expr(e);
+	add_node(user, n);
+}
+
+
+static void visit_bool_expr(struct bool_expr *e, void *user)
+{
+	struct node *n;
+
+	n = alloc_type(struct node);
+	n->is_bool = 1;
+	n->u.bool_expr = e;
+	n->hash = hash_bool_expr(e);
+	add_node(user, n);
+}
+
+
+static const struct expr_visitor visitor = { visit_expr, visit_bool_expr };
+
+
+/* ----- Invalidation lists ------------------------------------------------ */
+
+
+static void invalidation_list(struct cse_ctx *ctx, struct setting *s)
+{
+	bool cfg = s->op == set_cfg || s->op == set_clear_cfg;
+	const struct dep *d;
+	unsigned n = 0;
+
+	for (d = ctx->deps; d; d = d->next) {
+		if (d->cfg != cfg || strcmp(d->name, s->name))
+			continue;
+		s->invalidate = realloc_type_n(s->invalidate, n + 2);
+		s->invalidate[n++] = d->slot;
+		s->invalidate[n] = 0;
+	}
+}
+
+
+void cse_rules(struct rule *rules)
+{
+	struct cse_ctx ctx;
+	struct rule *r;
+	struct setting *s;
+	struct node *n, *next;
+	struct dep *d;
+	unsigned i;
+
+	ctx.n_buckets = 1024;
+	ctx.buckets = alloc_type_n(struct node *, ctx.n_buckets);
+	memset(ctx.buckets, 0, sizeof(struct node *) * ctx.n_buckets);
+	ctx.slots = 0;
+	ctx.deps = NULL;
+
+	walk_rules(rules, &visitor, &ctx);
+
+	for (r = rules; r; r = r->next)
+		for (s = r->settings; s; s = s->next)
+			invalidation_list(&ctx, s);
+
+	for (i = 0; i != ctx.n_buckets; i++)
+		for (n = ctx.buckets[i]; n; n = next) {
+			next = n->next;
+			free(n);
+		}
+	free(ctx.buckets);
+	while (ctx.deps) {
+		d = ctx.deps;
+		ctx.deps = d->next;
+		free(d);
+	}
+}
+
+
+/* ----- Run-time cache ---------------------------------------------------- */
+
+
+struct cse_cache *cse_new(void)
+{
+	struct cse_cache *c;
+
+	c = alloc_type(struct cse_cache);
+	c->entries = NULL;
+	c->n = 0;
+	return c;
+}
+
+
+struct cse_entry *cse_entry(const struct exec_env *exec, unsigned slot)
+{
+	struct cse_cache *c = exec->cse;
+
+	if (slot > c->n) {
+		c->entries = realloc_type_n(c->entries, slot);
+		memset(c->entries + c->n, 0,
+		    sizeof(struct cse_entry) * (slot - c->n));
+		c->n = slot;
+	}
+	return c->entries + slot - 1;
+}
+
+
+void cse_invalidate(const struct exec_env *exec, const unsigned *slots)
+{
+	struct cse_cache *c = exec->cse;
+	struct cse_entry *e;
+
+	while (*slots) {
+		if (*slots <= c->n) {
+			e = c->entries + *slots - 1;
+			if (e->v)
+				free_value(e->v);
+			e->v = NULL;
+			e->valid = 0;
+		}
+		slots++;
+	}
+}
+
+
+void cse_free(struct cse_cache *c)
+{
+	unsigned i;
+
+	for (i = 0; i != c->n; i++)
+		if (c->entries[i].v)
+			free_value(c->entries[i].v);
+	free(c->entries);
+	free(c);
+}
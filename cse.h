@@ -0,0 +1,43 @@
+/*
+ * cse.h - Common subexpression elimination
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef CSE_H
+#define	CSE_H
+
+#include <stdbool.h>
+
+#include "expr.h"
+#include "exec.h"
+
+
+struct cse_entry {
+	bool valid;
+	bool b;			/* result of a struct bool_expr */
+	struct value *v;	/* result of a struct expr */
+};
+
+struct cse_cache {
+	struct cse_entry *entries;	/* indexed by slot - 1 */
+	unsigned n;
+};
+
+
+/*
+ * cse_rules assigns cache slots to common subexpressions, and sets up the
+ * invalidation lists of settings.
+ */
+
+void cse_rules(struct rule *rules);
+
+struct cse_cache *cse_new(void);
+struct cse_entry *cse_entry(const struct exec_env *exec, unsigned slot);
+void cse_invalidate(const struct exec_env *exec, const unsigned *slots);
+void cse_free(struct cse_cache *c);
+
+#endif /* !CSE_H */
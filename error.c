@@ -20,9 +20,9 @@
 
 unsigned lineno = 1;
 char *file_name = NULL;
-void (*report)(char *s) = report_fatal;
+__thread void (*report)(char *s) = report_fatal;
 
-static char *last_error = NULL;
+static __thread char *last_error = NULL;
 
 
 /* ----- Reporting --------------------------------------------------------- */
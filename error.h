@@ -15,7 +15,9 @@
 
 extern unsigned lineno;
 extern char *file_name;
-extern void (*report)(char *s);
+
+/* error reporting is per thread, so that rules can be run in the background */
+extern __thread void (*report)(char *s);
 
 
 void report_fatal(char *s);
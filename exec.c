@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include "bonanza.h"
 #include "alloc.h"
@@ -18,14 +19,74 @@
 #include "expr.h"
 #include "var.h"
 #include "validate.h"
+#include "infer.h"
+#include "cse.h"
 #include "exec.h"
 
 #include "y.tab.h"
 
 
+/* check the clock only every so many steps */
+#define	TIME_CHECK_STEPS	256
+
+
+unsigned max_steps = DEFAULT_MAX_STEPS;
+size_t max_bytes = DEFAULT_MAX_BYTES;
+unsigned max_time_ms = DEFAULT_MAX_TIME_MS;
+
 static struct rule **rule_anchor;
 
 
+/* ----- Budget ------------------------------------------------------------ */
+
+
+static bool exhausted(struct exec_budget *b, const char *what)
+{
+	b->exhausted = 1;
+	errorf("%s:%u: %s limit exceeded", b->file, b->lineno, what);
+	return 0;
+}
+
+
+static unsigned elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+
+bool exec_step(const struct exec_env *exec)
+{
+	struct exec_budget *b = exec->budget;
+
+	if (b->exhausted)
+		return 0;
+	b->steps++;
+	if (max_steps && b->steps > max_steps)
+		return exhausted(b, "step");
+	if (max_time_ms && !(b->steps % TIME_CHECK_STEPS) &&
+	    elapsed_ms(&b->start) > max_time_ms)
+		return exhausted(b, "time");
+	return 1;
+}
+
+
+bool exec_alloc(const struct exec_env *exec, size_t bytes)
+{
+	struct exec_budget *b = exec->budget;
+
+	if (b->exhausted)
+		return 0;
+	b->bytes += bytes;
+	if (max_bytes && b->bytes > max_bytes)
+		return exhausted(b, "memory");
+	return 1;
+}
+
+
 /* ----- Execution --------------------------------------------------------- */
 
 
@@ -33,7 +94,7 @@ void set_clear_cfg(const struct setting *self, struct exec_env *exec)
 {
 	if (verbose)
 		printf("%s = {}\n", self->name);
-	var_unset_assoc(&exec->cfg_vars, self->name);
+	var_unset_assoc(exec->cfg_vars, self->name);
 }
 
 
@@ -41,7 +102,24 @@ void set_clear_var(const struct setting *self, struct exec_env *exec)
 {
 	if (verbose)
 		printf("%s = {}\n", self->name);
-	var_unset_assoc(&exec->script_vars, self->name);
+	var_unset_assoc(exec->script_vars, self->name);
+}
+
+
+/* the setting is known to be valid for the validation table */
+
+static bool prevalidated(const struct setting *self,
+    const struct validate *val)
+{
+	unsigned id, i;
+
+	if (!val)
+		return 0;
+	id = validate_id(val);
+	for (i = 0; i != self->n_checked; i++)
+		if (self->checked[i].id == id)
+			return self->checked[i].result == 2;
+	return 0;
 }
 
 
@@ -51,14 +129,20 @@ void set_cfg(const struct setting *self, struct exec_env *exec)
 	struct value *key = self->key ? evaluate(self->key, exec) : NULL;
 	char *s = v->s;
 
+	if (exec->budget->exhausted) {
+		free_value(v);
+		if (key)
+			free_value(key);
+		return;
+	}
 	if (verbose) {
 		if (key)
 			printf("%s[%s] = \"%s\"\n", self->name, key->s, s);
 		else
 			printf("%s = \"%s\"\n", self->name, s);
 	}
-	var_set(&exec->cfg_vars, self->name, key ? key->s : NULL, v,
-	    exec->validate);
+	var_set(exec->cfg_vars, self->name, key ? key->s : NULL, v,
+	    prevalidated(self, exec->validate) ? NULL : exec->validate);
 	if (key)
 		free_value(key);
 }
@@ -70,13 +154,19 @@ void set_var(const struct setting *self, struct exec_env *exec)
 	struct value *key = self->key ? evaluate(self->key, exec) : NULL;
 	char *s = v->s;
 
+	if (exec->budget->exhausted) {
+		free_value(v);
+		if (key)
+			free_value(key);
+		return;
+	}
 	if (verbose) {
 		if (key)
 			printf("%s[%s] = \"%s\"\n", self->name, key->s, s);
 		else
 			printf("%s = \"%s\"\n", self->name, s);
 	}
-	var_set(&exec->script_vars, self->name, key ? key->s : NULL, v, NULL);
+	var_set(exec->script_vars, self->name, key ? key->s : NULL, v, NULL);
 	if (key)
 		free_value(key);
 	if (magic && !strcmp(self->name, magic)) {
@@ -90,12 +180,21 @@ void set_var(const struct setting *self, struct exec_env *exec)
 
 enum magic_flags run(struct exec_env *exec, const struct rule *r)
 {
+	struct exec_budget *b = exec->budget;
 	struct setting *s;
 
 	while (r && !get_error() && !(exec->flags & mf_stop)) {
+		b->file = r->file;
+		b->lineno = r->lineno;
 		if (!r->cond || bool_evaluate(r->cond, exec))
-			for (s = r->settings; s; s = s->next)
+			for (s = r->settings; s && !b->exhausted; s = s->next) {
+				b->lineno = s->lineno;
+				if (!exec_step(exec))
+					break;
 				s->op(s, exec);
+				if (s->invalidate)
+					cse_invalidate(exec, s->invalidate);
+			}
 		r = r->next;
 	}
 
@@ -108,9 +207,17 @@ void exec_env_init(struct exec_env *exec, const char *dir,
 {
 	exec->dir = dir ? stralloc(dir) : NULL;
 	exec->validate = validate;
-	exec->cfg_vars = NULL;
-	exec->script_vars = NULL;
+	exec->cfg_vars = vars_new();
+	exec->script_vars = vars_new();
 	exec->flags = 0;
+	exec->budget = alloc_type(struct exec_budget);
+	exec->budget->steps = 0;
+	exec->budget->bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &exec->budget->start);
+	exec->budget->file = NULL;
+	exec->budget->lineno = 0;
+	exec->budget->exhausted = 0;
+	exec->cse = cse_new();
 }
 
 
@@ -119,6 +226,8 @@ void exec_env_free(struct exec_env *exec)
 	free(exec->dir);
 	free_vars(exec->cfg_vars);
 	free_vars(exec->script_vars);
+	free(exec->budget);
+	cse_free(exec->cse);
 }
 
 
@@ -176,12 +285,135 @@ void dump_rules(const struct rule *r)
 }
 
 
+/* ----- Traversal --------------------------------------------------------- */
+
+
+void walk_rules(struct rule *rules, const struct expr_visitor *v, void *user)
+{
+	struct rule *r;
+	struct setting *s;
+
+	for (r = rules; r; r = r->next) {
+		if (r->cond)
+			walk_bool_expr(r->cond, v, user);
+		for (s = r->settings; s; s = s->next) {
+			if (s->key)
+				walk_expr(s->key, v, user);
+			if (s->op == set_cfg || s->op == set_var)
+				walk_expr(s->expr, v, user);
+		}
+	}
+}
+
+
+/* ----- Pre-validation ---------------------------------------------------- */
+
+
+/*
+ * Many settings assign constants, e.g., TRIP_MASTER = "y". Instead of
+ * validating them every time they're executed, for every miner, we validate
+ * them once for each validation table, when the rules are loaded. Tables that
+ * only appear later are handled when the setting is executed.
+ */
+
+static bool constant(const struct expr *e)
+{
+	return e->op == op_string || e->op == op_num;
+}
+
+
+/* like op_string and op_num, but without charging an execution budget */
+
+static struct value *constant_value(const struct expr *e)
+{
+	return e->op == op_num ? numeric_value(e->a.s, e->b.n) :
+	    string_value(e->a.s);
+}
+
+
+static void add_error(char **errors, const struct rule *r,
+    const struct setting *s, const char *name, const char *value,
+    unsigned result)
+{
+	char *msg;
+
+	if (result)
+		asprintf_req(&msg, "%s:%u: invalid value '%s' for variable %s",
+		    r->file, s->lineno, value, name);
+	else
+		asprintf_req(&msg, "%s:%u: unrecognized variable '%s'",
+		    r->file, s->lineno, name);
+	if (*errors) {
+		*errors = stralloc_append(*errors, "\n");
+		*errors = stralloc_append(*errors, msg);
+		free(msg);
+	} else {
+		*errors = msg;
+	}
+}
+
+
+static void prevalidate_setting(char **errors, const struct rule *r,
+    struct setting *s, unsigned n)
+{
+	const struct validate *val;
+	struct value *v, *key = NULL;
+	char *name = NULL;
+	bool reported = 0;
+
+	v = constant_value(s->expr);
+	if (s->key) {
+		key = constant_value(s->key);
+		asprintf_req(&name, "%s_%s", s->name, key->s);
+		free_value(key);
+	}
+	s->checked = alloc_type_n(struct prevalidated, n);
+	s->n_checked = 0;
+	for (val = validate_shared(NULL); val; val = validate_shared(val)) {
+		struct prevalidated *p = s->checked + s->n_checked++;
+
+		p->id = validate_id(val);
+		p->result = validate(val, name ? name : s->name, v->s);
+		if (p->result != 2 && !reported) {
+			add_error(errors, r, s, name ? name : s->name, v->s,
+			    p->result);
+			reported = 1;
+		}
+	}
+	free(name);
+	free_value(v);
+}
+
+
+char *prevalidate(struct rule *rules)
+{
+	const struct validate *val;
+	struct rule *r;
+	struct setting *s;
+	char *errors = NULL;
+	unsigned n = 0;
+
+	for (val = validate_shared(NULL); val; val = validate_shared(val))
+		n++;
+	if (!n)
+		return NULL;
+	for (r = rules; r; r = r->next)
+		for (s = r->settings; s; s = s->next)
+			if (s->op == set_cfg && constant(s->expr) &&
+			    (!s->key || constant(s->key)))
+				prevalidate_setting(&errors, r, s, n);
+	return errors;
+}
+
+
 /* ----- Freeing ----------------------------------------------------------- */
 
 
 static void free_setting(struct setting *s)
 {
 	free((void *) s->name);
+	free(s->invalidate);
+	free(s->checked);
 	if (s->op == set_cfg || s->op == set_var) {
 		free_expr(s->expr);
 		if (s->key)
@@ -199,6 +431,7 @@ static void free_rule(struct rule *r)
 {
 	struct setting *s;
 
+	free(r->file);
 	if (r->cond)
 		free_bool_expr(r->cond);
 	while (r->settings) {
@@ -233,18 +466,23 @@ struct setting *new_setting(
 
 	s = alloc_type(struct setting);
 	s->op = op;
+	s->invalidate = NULL;
+	s->checked = NULL;
+	s->n_checked = 0;
 	s->next = NULL;
 	return s;
 }
 
 
-void add_rule(struct bool_expr *cond, struct setting *s)
+void add_rule(struct bool_expr *cond, struct setting *s, unsigned line)
 {
 	struct rule *r;
 
 	r = alloc_type(struct rule);
 	r->cond = cond;
 	r->settings = s;
+	r->file = stralloc(file_name);
+	r->lineno = line;
 	r->next = NULL;
 	*rule_anchor = r;
 	rule_anchor = &r->next;
@@ -262,14 +500,19 @@ struct rule *rules_file(const char *name)
 		return NULL;
 	}
 
+	pthread_mutex_lock(&parser_lock);
 	rule_anchor = &rules;
 	scan_rules(file, name);
 	if (yyparse()) {
+		pthread_mutex_unlock(&parser_lock);
 		fclose(file);
 		free_rules(rules);
 		return NULL;
 	}
+	pthread_mutex_unlock(&parser_lock);
 	fclose(file);
 
+	specialize_rules(rules);
+	cse_rules(rules);
 	return rules;
 }
@@ -10,23 +10,45 @@
 #ifndef EXEC_H
 #define	EXEC_H
 
+#include <stddef.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "expr.h"
 #include "validate.h"
 
 
+/*
+ * Limits for a single execution of the rules. 0 means "no limit".
+ */
+
+#define	DEFAULT_MAX_STEPS	1000000
+#define	DEFAULT_MAX_BYTES	(64 << 20)
+#define	DEFAULT_MAX_TIME_MS	500
+
+
+struct prevalidated {
+	unsigned id;		/* validation table, see validate_id */
+	unsigned result;	/* see validate */
+};
+
 struct setting {
 	void (*op)(const struct setting *self, struct exec_env *exec);
 	const char *name;
 	struct expr *expr;
 	struct expr *key;
+	unsigned lineno;
+	unsigned *invalidate;	/* CSE slots to invalidate, 0-terminated */
+	struct prevalidated *checked;	/* constant settings, see prevalidate */
+	unsigned n_checked;
 	struct setting *next;
 };
 
 struct rule {
 	struct bool_expr *cond;
 	struct setting *settings;
+	char *file;
+	unsigned lineno;
 	struct rule *next;
 };
 
@@ -36,20 +58,37 @@ enum magic_flags {
 	mf_dump		= 1 << 2,
 };
 
+struct cse_cache;
+
+struct exec_budget {
+	unsigned steps;		/* evaluation steps so far */
+	size_t bytes;		/* string bytes allocated so far */
+	struct timespec start;
+	const char *file;	/* location of what we're currently executing */
+	unsigned lineno;
+	bool exhausted;		/* a limit was exceeded; we've reported it */
+};
+
 struct exec_env {
 	/* setup */
 	char *dir;
 	const struct validate *validate;
 
 	/* run-time */
-	struct var *cfg_vars;
-	struct var *script_vars;
+	struct vars *cfg_vars;
+	struct vars *script_vars;
 	enum magic_flags flags;
+	struct exec_budget *budget;
+	struct cse_cache *cse;
 };
 
 
 extern bool stop;
 
+extern unsigned max_steps;
+extern size_t max_bytes;
+extern unsigned max_time_ms;
+
 
 void set_clear_cfg(const struct setting *self, struct exec_env *exec);
 void set_clear_var(const struct setting *self, struct exec_env *exec);
@@ -61,7 +100,15 @@ void dump_rules(const struct rule *c);
 
 struct setting *new_setting(
     void (*op)(const struct setting *self, struct exec_env *exec));
-void add_rule(struct bool_expr *cond, struct setting *s);
+void add_rule(struct bool_expr *cond, struct setting *s, unsigned line);
+
+/*
+ * exec_step and exec_alloc charge the execution budget. They return 0 if a
+ * limit has been exceeded (and report the error, the first time). Evaluation
+ * should then stop as quickly as possible.
+ */
+bool exec_step(const struct exec_env *exec);
+bool exec_alloc(const struct exec_env *exec, size_t bytes);
 
 enum magic_flags run(struct exec_env *exec, const struct rule *r);
 void exec_env_init(struct exec_env *exec, const char *dir,
@@ -71,4 +118,17 @@ void exec_env_free(struct exec_env *exec);
 struct rule *rules_file(const char *name);
 void free_rules(struct rule *r);
 
+/* walk_rules walks all the expressions in the rules, see walk_expr */
+
+void walk_rules(struct rule *rules, const struct expr_visitor *v, void *user);
+
+/*
+ * prevalidate validates the constant assignments to configuration variables
+ * against all the validation tables in use, and records the results in the
+ * settings. It returns the errors found (one per line), NULL if there are
+ * none. Since rules are usually conditional, these errors may not affect any
+ * miner.
+ */
+char *prevalidate(struct rule *rules);
+
 #endif /* !EXEC_H */
@@ -12,6 +12,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 
 #include "alloc.h"
@@ -19,21 +20,60 @@
 #include "host.h"
 #include "map.h"
 #include "exec.h"
+#include "cse.h"
 #include "expr.h"
 
 
 /* ----- Evaluation -------------------------------------------------------- */
 
 
+static struct value *duplicate_value(const struct value *v);
+static struct value *charged_copy(const struct exec_env *exec,
+    const struct value *v);
+
+
 struct value *evaluate(const struct expr *self, const struct exec_env *exec)
 {
-	return self->op(self, exec);
+	struct cse_entry *ce;
+	struct value *v;
+
+	if (!exec_step(exec))
+		return string_value("");
+	if (self->cse) {
+		ce = cse_entry(exec, self->cse);
+		if (ce->valid) {
+			v = charged_copy(exec, ce->v);
+		} else {
+			v = self->op(self, exec);
+			/* evaluation may have moved the cache */
+			ce = cse_entry(exec, self->cse);
+			ce->v = duplicate_value(v);
+			ce->valid = 1;
+		}
+	} else {
+		v = self->op(self, exec);
+	}
+	return v;
 }
 
 
 bool bool_evaluate(const struct bool_expr *self, const struct exec_env *exec)
 {
-	return self->op(self, exec);
+	struct cse_entry *ce;
+	bool res;
+
+	if (!exec_step(exec))
+		return 0;
+	if (!self->cse)
+		return self->op(self, exec);
+	ce = cse_entry(exec, self->cse);
+	if (ce->valid)
+		return ce->b;
+	res = self->op(self, exec);
+	ce = cse_entry(exec, self->cse);
+	ce->b = res;
+	ce->valid = 1;
+	return res;
 }
 
 
@@ -142,12 +182,150 @@ bool op_ge(const struct bool_expr *self, const struct exec_env *exec)
 }
 
 
+/*
+ * Comparisons with a constant (b), as set up by specialize_rules. We fetch the
+ * other operand without copying it if we can, and don't need to materialize
+ * the constant at all. The result is the same as with compare().
+ */
+
+static const struct value *peek(const struct expr *e,
+    const struct exec_env *exec, struct value **tmp)
+{
+	static const struct value empty = { .num = 0, .s = "", .n = 0 };
+	const struct value *v;
+
+	*tmp = NULL;
+	if (e->op == op_var && !e->key) {
+		v = var_get(exec->script_vars, e->a.s, NULL);
+		return v ? v : &empty;
+	}
+	if (e->op == op_cfg && !e->key) {
+		v = var_get(exec->cfg_vars, e->a.s, NULL);
+		return v ? v : &empty;
+	}
+	*tmp = evaluate(e, exec);
+	return *tmp;
+}
+
+
+static int compare_num(const struct bool_expr *self,
+    const struct exec_env *exec)
+{
+	const struct expr *c = self->b.expr;
+	struct value *tmp;
+	const struct value *a = peek(self->a.expr, exec, &tmp);
+	int res;
+
+	if (a->num)
+		res = a->n < c->b.n ? -1 : a->n == c->b.n ? 0 : 1;
+	else
+		res = strcmp(a->s, c->a.s);
+	if (tmp)
+		free_value(tmp);
+	return res;
+}
+
+
+static int compare_str(const struct bool_expr *self,
+    const struct exec_env *exec)
+{
+	struct value *tmp;
+	const struct value *a = peek(self->a.expr, exec, &tmp);
+	int res;
+
+	res = strcmp(a->s, self->b.expr->a.s);
+	if (tmp)
+		free_value(tmp);
+	return res;
+}
+
+
+bool op_eq_num(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_num(self, exec) == 0;
+}
+
+
+bool op_ne_num(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_num(self, exec) != 0;
+}
+
+
+bool op_lt_num(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_num(self, exec) < 0;
+}
+
+
+bool op_le_num(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_num(self, exec) <= 0;
+}
+
+
+bool op_gt_num(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_num(self, exec) > 0;
+}
+
+
+bool op_ge_num(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_num(self, exec) >= 0;
+}
+
+
+bool op_eq_str(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_str(self, exec) == 0;
+}
+
+
+bool op_ne_str(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_str(self, exec) != 0;
+}
+
+
+bool op_lt_str(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_str(self, exec) < 0;
+}
+
+
+bool op_le_str(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_str(self, exec) <= 0;
+}
+
+
+bool op_gt_str(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_str(self, exec) > 0;
+}
+
+
+bool op_ge_str(const struct bool_expr *self, const struct exec_env *exec)
+{
+	return compare_str(self, exec) >= 0;
+}
+
+
 bool op_in_file(const struct bool_expr *self, const struct exec_env *exec)
 {
 	struct value *a = evaluate(self->a.expr, exec);
 	bool res;
 	char *s = NULL;
 
+	if (self->hosts && self->gen == generation_value(self->dir_gen)) {
+		if (a->num)
+			res = host_file_contains_ipv4(self->hosts, a->n);
+		else
+			res = host_file_contains_name(self->hosts, a->s);
+		free_value(a);
+		return res;
+	}
 	if (exec->dir && asprintf(&s, "%s/%s", exec->dir, self->b.s) < 0) {
 		perror("asprintf");
 		exit(1);
@@ -190,16 +368,44 @@ bool op_bool(const struct bool_expr *self, const struct exec_env *exec)
 
 struct value *op_concat(const struct expr *self, const struct exec_env *exec)
 {
-	struct value *a = evaluate(self->a.expr, exec);
-	struct value *b = evaluate(self->b.expr, exec);
-	size_t a_len = strlen(a->s);
-	size_t b_len = strlen(b->s);
+	struct part {
+		struct value *v;
+		size_t len;
+	} *parts;
+	struct value *res;
+	size_t len = 0;
+	unsigned i;
+	char *buf, *p;
+
+	parts = alloc_type_n(struct part, self->b.n);
+	for (i = 0; i != self->b.n; i++) {
+		parts[i].v = evaluate(self->a.exprs[i], exec);
+		parts[i].len = strlen(parts[i].v->s);
+		len += parts[i].len;
+	}
+	if (!exec_alloc(exec, len + 1)) {
+		for (i = 0; i != self->b.n; i++)
+			free_value(parts[i].v);
+		free(parts);
+		return string_value("");
+	}
 
-	a->s = realloc(a->s, a_len + b_len + 1);
-	memcpy(a->s + a_len, b->s, b_len + 1);
-	free(b->s);
-	free(b);
-	return a;
+	/*
+	 * The result inherits the type (and numeric value) of the first part.
+	 */
+	res = parts[0].v;
+	buf = p = alloc_size(len + 1);
+	for (i = 0; i != self->b.n; i++) {
+		memcpy(p, parts[i].v->s, parts[i].len);
+		p += parts[i].len;
+		if (i)
+			free_value(parts[i].v);
+	}
+	*p = 0;
+	free(res->s);
+	res->s = buf;
+	free(parts);
+	return res;
 }
 
 
@@ -244,14 +450,67 @@ static struct value *duplicate_value(const struct value *v)
 }
 
 
+/*
+ * Values produced by evaluation are charged to the execution budget before
+ * their string is allocated. If the budget is exhausted, we return an empty
+ * string instead.
+ */
+
+static char *charged_strdup(const struct exec_env *exec, const char *s)
+{
+	size_t len = strlen(s);
+	char *new;
+
+	if (!exec_alloc(exec, len + 1))
+		return NULL;
+	new = alloc_size(len + 1);
+	memcpy(new, s, len + 1);
+	return new;
+}
+
+
+static struct value *charged_copy(const struct exec_env *exec,
+    const struct value *v)
+{
+	struct value *new;
+	char *s = charged_strdup(exec, v->s);
+
+	if (!s)
+		return string_value("");
+	new = alloc_type(struct value);
+	new->num = v->num;
+	new->s = s;
+	new->n = v->n;
+	return new;
+}
+
+
+static struct value *charged_string(const struct exec_env *exec,
+    const char *s)
+{
+	struct value *v;
+	char *tmp = charged_strdup(exec, s);
+
+	if (!tmp)
+		return string_value("");
+	v = alloc_type(struct value);
+	v->num = 0;
+	v->s = tmp;
+	return v;
+}
+
+
 struct value *op_string(const struct expr *self, const struct exec_env *exec)
 {
-	return string_value(self->a.s);
+	return charged_string(exec, self->a.s);
 }
 
 
 struct value *op_num(const struct expr *self, const struct exec_env *exec)
 {
+	if (!exec_alloc(exec, self->a.s ? strlen(self->a.s) + 1 :
+	    sizeof("4294967295")))
+		return string_value("");
 	return numeric_value(self->a.s, self->b.n);
 }
 
@@ -262,7 +521,7 @@ struct value *op_cfg(const struct expr *self, const struct exec_env *exec)
 	const struct value *v = var_get(exec->cfg_vars, self->a.s, key);
 
 	free(key);
-	return v ? duplicate_value(v) : string_value("");
+	return v ? charged_copy(exec, v) : charged_string(exec, "");
 }
 
 
@@ -272,7 +531,7 @@ struct value *op_var(const struct expr *self, const struct exec_env *exec)
 	const struct value *v = var_get(exec->script_vars, self->a.s, key);
 
 	free(key);
-	return v ? duplicate_value(v) : string_value("");
+	return v ? charged_copy(exec, v) : charged_string(exec, "");
 }
 
 
@@ -282,6 +541,11 @@ struct value *op_map(const struct expr *self, const struct exec_env *exec)
 	const char *value;
 	char *s = NULL;
 
+	if (self->map && self->gen == generation_value(self->dir_gen)) {
+		value = map_file_lookup(self->map, key);
+		free(key);
+		return charged_string(exec, value ? value : "");
+	}
 	if (exec->dir && asprintf(&s, "%s/%s", exec->dir, self->a.s) < 0) {
 		perror("asprintf");
 		exit(1);
@@ -289,7 +553,7 @@ struct value *op_map(const struct expr *self, const struct exec_env *exec)
 	value = file_map(s ? s : self->a.s, key);
 	free(s);
 	free(key);
-	return string_value(value ? value : "");
+	return charged_string(exec, value ? value : "");
 }
 
 
@@ -303,6 +567,10 @@ struct bool_expr *new_bool_op(
 
 	e = alloc_type(struct bool_expr);
 	e->op = op;
+	e->cse = 0;
+	e->hosts = NULL;
+	e->dir_gen = NULL;
+	e->gen = 0;
 	return e;
 }
 
@@ -314,6 +582,32 @@ struct expr *new_op(
 
 	e = alloc_type(struct expr);
 	e->op = op;
+	e->cse = 0;
+	e->map = NULL;
+	e->dir_gen = NULL;
+	e->gen = 0;
+	return e;
+}
+
+
+/*
+ * "a + b + c" is parsed as "(a + b) + c". Instead of nesting, we collect all
+ * the parts in a single node, so that the result can be built in one pass.
+ */
+
+struct expr *new_concat(struct expr *a, struct expr *b)
+{
+	struct expr *e = a;
+
+	if (a->op != op_concat) {
+		e = new_op(op_concat);
+		e->a.exprs = alloc_type_n(struct expr *, 2);
+		e->a.exprs[0] = a;
+		e->b.n = 1;
+	} else {
+		e->a.exprs = realloc_type_n(e->a.exprs, e->b.n + 1);
+	}
+	e->a.exprs[e->b.n++] = b;
 	return e;
 }
 
@@ -329,6 +623,33 @@ struct list *new_list_item(struct expr *expr)
 }
 
 
+/* ----- Operator classes ------------------------------------------------- */
+
+
+bool is_num_relop(
+    bool (*op)(const struct bool_expr *self, const struct exec_env *exec))
+{
+	return op == op_eq_num || op == op_ne_num || op == op_lt_num ||
+	    op == op_le_num || op == op_gt_num || op == op_ge_num;
+}
+
+
+bool is_str_relop(
+    bool (*op)(const struct bool_expr *self, const struct exec_env *exec))
+{
+	return op == op_eq_str || op == op_ne_str || op == op_lt_str ||
+	    op == op_le_str || op == op_gt_str || op == op_ge_str;
+}
+
+
+bool is_relop(
+    bool (*op)(const struct bool_expr *self, const struct exec_env *exec))
+{
+	return op == op_eq || op == op_ne || op == op_lt || op == op_le ||
+	    op == op_gt || op == op_ge || is_num_relop(op) || is_str_relop(op);
+}
+
+
 /* ----- Dumping ----------------------------------------------------------- */
 
 
@@ -382,23 +703,27 @@ void dump_bool_expr(const struct bool_expr *e)
 	} else {
 		const char *relop;
 
-		if (op == op_eq)
+		if (op == op_eq || op == op_eq_num || op == op_eq_str)
 			relop = "==";
-		else if (op == op_ne)
+		else if (op == op_ne || op == op_ne_num || op == op_ne_str)
 			relop = "!=";
-		else if (op == op_lt)
+		else if (op == op_lt || op == op_lt_num || op == op_lt_str)
 			relop = "<";
-		else if (op == op_le)
+		else if (op == op_le || op == op_le_num || op == op_le_str)
 			relop = "<=";
-		else if (op == op_gt)
+		else if (op == op_gt || op == op_gt_num || op == op_gt_str)
 			relop = ">";
-		else if (op == op_ge)
+		else if (op == op_ge || op == op_ge_num || op == op_ge_str)
 			relop = ">=";
 		else
 			abort();
 		dump_expr(e->a.expr);
 		printf(" %s ", relop);
 		dump_expr(e->b.expr);
+		if (is_num_relop(op))
+			printf(" /* num */");
+		if (is_str_relop(op))
+			printf(" /* str */");
 	}
 }
 
@@ -417,9 +742,13 @@ void dump_expr(const struct expr *e)
 	} else if (op == op_var) {
 		printf("%s", e->a.s);
 	} else if (op == op_concat) {
-		dump_expr(e->a.expr);
-		printf(" + ");
-		dump_expr(e->b.expr);
+		unsigned i;
+
+		for (i = 0; i != e->b.n; i++) {
+			if (i)
+				printf(" + ");
+			dump_expr(e->a.exprs[i]);
+		}
 	} else if (op == op_map) {
 		printf("%s[", e->a.s);
 		dump_expr(e->b.expr);
@@ -430,6 +759,60 @@ void dump_expr(const struct expr *e)
 }
 
 
+/* ----- Traversal --------------------------------------------------------- */
+
+
+void walk_expr(struct expr *e, const struct expr_visitor *v, void *user)
+{
+	struct value *(*op)(const struct expr *self,
+	    const struct exec_env *exec) = e->op;
+	unsigned i;
+
+	if (op == op_cfg || op == op_var) {
+		if (e->key)
+			walk_expr(e->key, v, user);
+	} else if (op == op_concat) {
+		for (i = 0; i != e->b.n; i++)
+			walk_expr(e->a.exprs[i], v, user);
+	} else if (op == op_map) {
+		walk_expr(e->b.expr, v, user);
+	} else if (op != op_string && op != op_num) {
+		abort();
+	}
+	if (v->expr)
+		v->expr(e, user);
+}
+
+
+void walk_bool_expr(struct bool_expr *e, const struct expr_visitor *v,
+    void *user)
+{
+	bool (*op)(const struct bool_expr *self, const struct exec_env *exec) =
+	    e->op;
+	struct list *l;
+
+	if (op == op_or || op == op_and) {
+		walk_bool_expr(e->a.bool_expr, v, user);
+		walk_bool_expr(e->b.bool_expr, v, user);
+	} else if (op == op_not) {
+		walk_bool_expr(e->a.bool_expr, v, user);
+	} else if (is_relop(op)) {
+		walk_expr(e->a.expr, v, user);
+		walk_expr(e->b.expr, v, user);
+	} else if (op == op_in_list) {
+		walk_expr(e->a.expr, v, user);
+		for (l = e->b.list; l; l = l->next)
+			walk_expr(l->expr, v, user);
+	} else if (op == op_bool || op == op_in_file) {
+		walk_expr(e->a.expr, v, user);
+	} else {
+		abort();
+	}
+	if (v->bool_expr)
+		v->bool_expr(e, user);
+}
+
+
 /* ----- Freeing allocations ----------------------------------------------- */
 
 
@@ -463,8 +846,7 @@ void free_bool_expr(struct bool_expr *e)
 		free_bool_expr(e->b.bool_expr);
 	} else if (op == op_not) {
 		free_bool_expr(e->a.bool_expr);
-	} else if ( op == op_eq || op == op_ne || op == op_lt || op == op_le ||
-	    op == op_gt || op == op_ge) {
+	} else if (is_relop(op)) {
 		free_expr(e->a.expr);
 		free_expr(e->b.expr);
 	} else if (op == op_bool) {
@@ -490,8 +872,11 @@ void free_expr(struct expr *e)
 	if (op == op_string || op == op_num || op == op_cfg || op == op_var) {
 		free(e->a.s);
 	} else if (op == op_concat) {
-		free_expr(e->a.expr);
-		free_expr(e->b.expr);
+		unsigned i;
+
+		for (i = 0; i != e->b.n; i++)
+			free_expr(e->a.exprs[i]);
+		free(e->a.exprs);
 	} else if (op == op_map) {
 		free(e->a.s);
 		free_expr(e->b.expr);
@@ -12,9 +12,13 @@
 
 #include <stdbool.h>
 
+#include "gen.h"
+
 
 struct exec_env;
 struct expr;
+struct map_file;
+struct host_file;
 
 struct list {
 	struct expr *expr;
@@ -26,14 +30,19 @@ struct expr {
 	    const struct exec_env *exec);
 	union {
 		struct expr *expr;
+		struct expr **exprs;	/* op_concat: the parts, in order */
 		char *s;
 	} a;
 	union {
 		struct expr *expr;
-		unsigned n;
+		unsigned n;		/* op_concat: number of parts */
 		char *s;
 	} b;
 	struct expr *key;
+	unsigned cse;			/* CSE cache slot, 0 if none */
+	const struct map_file *map;	/* op_map: bound file */
+	const struct generation *dir_gen; /* of the bound file's directory */
+	unsigned gen;			/* generation of the binding */
 };
 
 struct bool_expr {
@@ -49,6 +58,10 @@ struct bool_expr {
 		struct list *list;
 	} b;
 	struct expr *key;
+	unsigned cse;			/* CSE cache slot, 0 if none */
+	const struct host_file *hosts;	/* op_in_file: bound file */
+	const struct generation *dir_gen; /* of the bound file's directory */
+	unsigned gen;			/* generation of the binding */
 };
 
 struct value {
@@ -69,6 +82,20 @@ bool op_le(const struct bool_expr *self, const struct exec_env *exec);
 bool op_gt(const struct bool_expr *self, const struct exec_env *exec);
 bool op_ge(const struct bool_expr *self, const struct exec_env *exec);
 
+bool op_eq_num(const struct bool_expr *self, const struct exec_env *exec);
+bool op_ne_num(const struct bool_expr *self, const struct exec_env *exec);
+bool op_lt_num(const struct bool_expr *self, const struct exec_env *exec);
+bool op_le_num(const struct bool_expr *self, const struct exec_env *exec);
+bool op_gt_num(const struct bool_expr *self, const struct exec_env *exec);
+bool op_ge_num(const struct bool_expr *self, const struct exec_env *exec);
+
+bool op_eq_str(const struct bool_expr *self, const struct exec_env *exec);
+bool op_ne_str(const struct bool_expr *self, const struct exec_env *exec);
+bool op_lt_str(const struct bool_expr *self, const struct exec_env *exec);
+bool op_le_str(const struct bool_expr *self, const struct exec_env *exec);
+bool op_gt_str(const struct bool_expr *self, const struct exec_env *exec);
+bool op_ge_str(const struct bool_expr *self, const struct exec_env *exec);
+
 bool op_in_file(const struct bool_expr *self, const struct exec_env *exec);
 bool op_in_list(const struct bool_expr *self, const struct exec_env *exec);
 
@@ -86,10 +113,18 @@ struct value *op_var(const struct expr *self, const struct exec_env *exec);
 
 struct value *op_map(const struct expr *self, const struct exec_env *exec);
 
+bool is_num_relop(
+    bool (*op)(const struct bool_expr *self, const struct exec_env *exec));
+bool is_str_relop(
+    bool (*op)(const struct bool_expr *self, const struct exec_env *exec));
+bool is_relop(
+    bool (*op)(const struct bool_expr *self, const struct exec_env *exec));
+
 struct bool_expr *new_bool_op(
     bool (*op)(const struct bool_expr *self, const struct exec_env *exec));
 struct expr *new_op(
     struct value *(*op)(const struct expr *self, const struct exec_env *exec));
+struct expr *new_concat(struct expr *a, struct expr *b);
 struct list *new_list_item(struct expr *expr);
 
 struct value *evaluate(const struct expr *self, const struct exec_env *exec);
@@ -97,6 +132,20 @@ bool bool_evaluate(const struct bool_expr *self, const struct exec_env *exec);
 bool eval_boolean(struct value *v);
 char *eval_string(struct value *v);
 
+/*
+ * walk_expr and walk_bool_expr call the visitor for all the nodes of an
+ * expression, children before their parent. Either callback can be NULL.
+ */
+
+struct expr_visitor {
+	void (*expr)(struct expr *e, void *user);
+	void (*bool_expr)(struct bool_expr *e, void *user);
+};
+
+void walk_expr(struct expr *e, const struct expr_visitor *v, void *user);
+void walk_bool_expr(struct bool_expr *e, const struct expr_visitor *v,
+    void *user);
+
 void dump_value(const struct value *v);
 
 void dump_bool_expr(const struct bool_expr *e);
@@ -0,0 +1,82 @@
+/*
+ * gen.c - Per-directory generation counters
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "alloc.h"
+#include "gen.h"
+
+
+struct generation {
+	char *dir;		/* "" for files without directory */
+	unsigned value;		/* atomic */
+	struct generation *next;
+};
+
+
+/* call with gens->lock held */
+
+static struct generation *find(struct generations *gens, const char *name)
+{
+	const char *slash = strrchr(name, '/');
+	size_t len = slash ? (size_t) (slash - name) : 0;
+	struct generation *gen;
+
+	for (gen = gens->list; gen; gen = gen->next)
+		if (strlen(gen->dir) == len && !strncmp(gen->dir, name, len))
+			return gen;
+	gen = alloc_type(struct generation);
+	gen->dir = strnalloc(name, len);
+	gen->value = 1;
+	gen->next = gens->list;
+	gens->list = gen;
+	return gen;
+}
+
+
+const struct generation *generation_of(struct generations *gens,
+    const char *name)
+{
+	const struct generation *gen;
+
+	pthread_mutex_lock(&gens->lock);
+	gen = find(gens, name);
+	pthread_mutex_unlock(&gens->lock);
+	return gen;
+}
+
+
+unsigned generation_value(const struct generation *gen)
+{
+	return __atomic_load_n(&gen->value, __ATOMIC_ACQUIRE);
+}
+
+
+void generation_bump(struct generations *gens, const char *name)
+{
+	struct generation *gen;
+
+	pthread_mutex_lock(&gens->lock);
+	gen = find(gens, name);
+	__atomic_add_fetch(&gen->value, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&gens->lock);
+}
+
+
+void generation_bump_all(struct generations *gens)
+{
+	struct generation *gen;
+
+	pthread_mutex_lock(&gens->lock);
+	for (gen = gens->list; gen; gen = gen->next)
+		__atomic_add_fetch(&gen->value, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&gens->lock);
+}
@@ -0,0 +1,44 @@
+/*
+ * gen.h - Per-directory generation counters
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef GEN_H
+#define	GEN_H
+
+#include <pthread.h>
+
+
+struct generation;
+
+struct generations {
+	pthread_mutex_t lock;
+	struct generation *list;
+};
+
+#define	GENERATIONS_INIT	{ PTHREAD_MUTEX_INITIALIZER, NULL }
+
+
+/*
+ * Rules bind to loaded map and host files, and have to look the files up
+ * again when files are dropped. Generation counters tell them when. There is
+ * one counter for each directory, so that dropping files in one directory
+ * doesn't affect the bindings to files in another.
+ *
+ * generation_of returns the counter of the directory of the file "name".
+ * Counters are never freed. generation_value can be called from any thread.
+ * generation_bump increments the counter of the directory of "name", and
+ * generation_bump_all increments all counters.
+ */
+
+const struct generation *generation_of(struct generations *gens,
+    const char *name);
+unsigned generation_value(const struct generation *gen);
+void generation_bump(struct generations *gens, const char *name);
+void generation_bump_all(struct generations *gens);
+
+#endif /* !GEN_H */
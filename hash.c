@@ -1,38 +1,309 @@
 /*
- * hash.c - Wrapper for MD5
+ * hash.c - Hash functions
  *
- * Copyright (C) 2022 Linzhi Ltd.
+ * Copyright (C) 2022, 2023 Linzhi Ltd.
  *
  * This work is licensed under the terms of the MIT License.
  * A copy of the license can be found in the file COPYING.txt
  */
 
+/*
+ * The 128-bit hash follows the structure of XXH3: eight 64-bit accumulators
+ * take in 64-byte stripes, using 32x32-bit multiplications, and are scrambled
+ * every STRIPES_PER_BLOCK stripes. The final stripe is padded with zeroes,
+ * and the total length is mixed into the result.
+ *
+ * With SSE2, two accumulators are processed per instruction. The results are
+ * the same as with the plain C implementation.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
-#include <md5.h>
+
+#if defined(__SSE2__) && !defined(HASH_NO_SIMD)
+#define	HASH_SSE2
+#include <emmintrin.h>
+#endif
 
 #include "alloc.h"
 #include "hash.h"
 
 
-static MD5_CTX ctx;
+#define	STRIPES_PER_BLOCK	16
+
+#define	PRIME32_1	0x9e3779b1U
+#define	PRIME64_1	0x9e3779b185ebca87ULL
+#define	PRIME64_2	0xc2b2ae3d27d4eb4fULL
+#define	AVALANCHE	0x165667919e3779f9ULL
+
+
+/*
+ * 0-7: accumulation, 8-15: scrambling, 16-23: final mixing
+ * (from splitmix64)
+ */
+
+static const uint64_t secret[24] __attribute__((aligned(16))) = {
+	0xeddc091ce00616e1, 0x44fdc3b24f4eb7b4, 0x15b1f2b2f2e0f9c6,
+	0xc680ca0291f1907f, 0xc8bd5acf09605f09, 0x0b4c5ce8b10cbb65,
+	0x562e7db2be1d83b2, 0x51f72f25f7658ce6, 0x91589f059e869dbe,
+	0x5ac7d047acc5aa9a, 0x47010e41a0fd59e1, 0x8393284118469de0,
+	0xc79fcacf0fac5f1d, 0xbae4017074fb5a7d, 0x2dc8b6a1780c73dc,
+	0x83d581f56e365771, 0x848f42f478984666, 0xc07f054fdc779a62,
+	0x906cba46b29b1626, 0xab927ff1d7651209, 0x00776638329059b4,
+	0x3a9978df6d0bd4c5, 0x820b1e60c85958e6, 0x3d2ebf9507032bfc,
+};
+
+
+/* ----- Stripes ----------------------------------------------------------- */
+
+
+#ifdef HASH_SSE2
+
+static void accumulate(uint64_t *acc, const uint8_t *in)
+{
+	__m128i *a = (__m128i *) acc;
+	const __m128i *k = (const __m128i *) secret;
+	unsigned i;
+
+	for (i = 0; i != 4; i++) {
+		__m128i data = _mm_loadu_si128((const __m128i *) in + i);
+		__m128i key = _mm_xor_si128(data, _mm_load_si128(k + i));
+		__m128i key_hi =
+		    _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1));
+		__m128i product = _mm_mul_epu32(key, key_hi);
+		__m128i swapped =
+		    _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+
+		a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, swapped));
+	}
+}
+
+
+static void scramble(uint64_t *acc)
+{
+	__m128i *a = (__m128i *) acc;
+	const __m128i *k = (const __m128i *) (secret + 8);
+	const __m128i prime = _mm_set1_epi32(PRIME32_1);
+	unsigned i;
+
+	for (i = 0; i != 4; i++) {
+		__m128i v = a[i];
+		__m128i lo, hi;
+
+		v = _mm_xor_si128(v, _mm_srli_epi64(v, 47));
+		v = _mm_xor_si128(v, _mm_load_si128(k + i));
+		lo = _mm_mul_epu32(v, prime);
+		hi = _mm_mul_epu32(_mm_srli_epi64(v, 32), prime);
+		a[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+	}
+}
 
+#else /* HASH_SSE2 */
 
-void hash_begin(void)
+static uint64_t read64(const uint8_t *p)
 {
-	MD5Init(&ctx);
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
 }
 
 
-void hash_add(const void *data, size_t len)
+static void accumulate(uint64_t *acc, const uint8_t *in)
 {
-	MD5Update(&ctx, data, len);
+	unsigned i;
+
+	for (i = 0; i != 8; i++) {
+		uint64_t data = read64(in + 8 * i);
+		uint64_t key = data ^ secret[i];
+
+		acc[i ^ 1] += data;
+		acc[i] += (key & 0xffffffff) * (key >> 32);
+	}
 }
 
 
-char *hash_end(void)
+static void scramble(uint64_t *acc)
 {
-	char buf[MD5_DIGEST_STRING_LENGTH];
+	unsigned i;
 
-	MD5End(&ctx, buf);
+	for (i = 0; i != 8; i++) {
+		acc[i] ^= acc[i] >> 47;
+		acc[i] ^= secret[8 + i];
+		acc[i] *= PRIME32_1;
+	}
+}
+
+#endif /* !HASH_SSE2 */
+
+
+static void stripe(struct hash_ctx *ctx, const uint8_t *in)
+{
+	accumulate(ctx->acc, in);
+	if (++ctx->stripes == STRIPES_PER_BLOCK) {
+		scramble(ctx->acc);
+		ctx->stripes = 0;
+	}
+}
+
+
+/* ----- 128-bit hash ------------------------------------------------------ */
+
+
+void hash_init(struct hash_ctx *ctx)
+{
+	ctx->acc[0] = 0xc2b2ae3d;
+	ctx->acc[1] = PRIME64_1;
+	ctx->acc[2] = PRIME64_2;
+	ctx->acc[3] = 0x165667b19e3779f9ULL;
+	ctx->acc[4] = 0x85ebca77c2b2ae63ULL;
+	ctx->acc[5] = 0x85ebca77;
+	ctx->acc[6] = 0x27d4eb2f165667c5ULL;
+	ctx->acc[7] = PRIME32_1;
+	ctx->buffered = 0;
+	ctx->stripes = 0;
+	ctx->len = 0;
+}
+
+
+void hash_update(struct hash_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n;
+
+	ctx->len += len;
+	if (ctx->buffered) {
+		n = HASH_STRIPE - ctx->buffered;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + ctx->buffered, p, n);
+		ctx->buffered += n;
+		p += n;
+		len -= n;
+		if (ctx->buffered != HASH_STRIPE)
+			return;
+		stripe(ctx, ctx->buf);
+		ctx->buffered = 0;
+	}
+	while (len >= HASH_STRIPE) {
+		stripe(ctx, p);
+		p += HASH_STRIPE;
+		len -= HASH_STRIPE;
+	}
+	memcpy(ctx->buf, p, len);
+	ctx->buffered = len;
+}
+
+
+static uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 p = (unsigned __int128) a * b;
+
+	return (uint64_t) p ^ (uint64_t) (p >> 64);
+#else
+	uint64_t lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+	uint64_t hi_lo = (a >> 32) * (b & 0xffffffff);
+	uint64_t lo_hi = (a & 0xffffffff) * (b >> 32);
+	uint64_t hi_hi = (a >> 32) * (b >> 32);
+	uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+	uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+	uint64_t lower = cross << 32 | (lo_lo & 0xffffffff);
+
+	return lower ^ upper;
+#endif
+}
+
+
+static uint64_t avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= AVALANCHE;
+	return h ^ h >> 32;
+}
+
+
+void hash_final(struct hash_ctx *ctx, struct fingerprint *h)
+{
+	const uint64_t *acc = ctx->acc;
+	const uint64_t *k = secret + 16;
+	uint64_t lo = ctx->len * PRIME64_1;
+	uint64_t hi = ~ctx->len * PRIME64_2;
+	unsigned i;
+
+	if (ctx->buffered) {
+		memset(ctx->buf + ctx->buffered, 0,
+		    HASH_STRIPE - ctx->buffered);
+		accumulate(ctx->acc, ctx->buf);
+	}
+	for (i = 0; i != 8; i += 2) {
+		lo += mul128_fold64(acc[i] ^ k[i], acc[i + 1] ^ k[i + 1]);
+		hi += mul128_fold64(acc[i] ^ k[(i + 3) & 7],
+		    acc[i + 1] ^ k[(i + 4) & 7]);
+	}
+	h->lo = avalanche(lo);
+	h->hi = avalanche(hi);
+}
+
+
+/* ----- Fingerprints ------------------------------------------------------ */
+
+
+void fingerprint_add(struct fingerprint *fp, const struct fingerprint *item)
+{
+	fp->lo += item->lo;
+	fp->hi += item->hi + (fp->lo < item->lo);
+}
+
+
+void fingerprint_sub(struct fingerprint *fp, const struct fingerprint *item)
+{
+	bool borrow = fp->lo < item->lo;
+
+	fp->lo -= item->lo;
+	fp->hi -= item->hi + borrow;
+}
+
+
+char *fingerprint_string(const struct fingerprint *fp)
+{
+	char buf[2 * 16 + 1];
+
+	sprintf(buf, "%016llx%016llx",
+	    (unsigned long long) fp->hi, (unsigned long long) fp->lo);
 	return stralloc(buf);
 }
+
+
+/* ----- Index hash -------------------------------------------------------- */
+
+
+uint32_t hash_str_continue(uint32_t h, const char *s)
+{
+	while (*s)
+		h = fnv_mix(h, (unsigned char) *s++);
+	return h;
+}
+
+
+uint32_t hash_str(const char *s)
+{
+	return hash_str_continue(FNV_OFFSET, s);
+}
+
+
+uint32_t hash_str_nocase(const char *s)
+{
+	uint32_t h = FNV_OFFSET;
+
+	while (*s)
+		h = fnv_mix(h, tolower((unsigned char) *s++));
+	return h;
+}
@@ -1,7 +1,7 @@
 /*
- * hash.h - Wrapper for MD5
+ * hash.h - Hash functions
  *
- * Copyright (C) 2022 Linzhi Ltd.
+ * Copyright (C) 2022, 2023 Linzhi Ltd.
  *
  * This work is licensed under the terms of the MIT License.
  * A copy of the license can be found in the file COPYING.txt
@@ -10,11 +10,65 @@
 #ifndef HASH_H
 #define	HASH_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
 
-void hash_begin(void);
-void hash_add(const void *data, size_t len);
-char *hash_end(void);
+#define	HASH_STRIPE	64	/* bytes processed at a time */
+
+
+/*
+ * A fast, non-cryptographic 128-bit hash, in the style of XXH3. The state is
+ * kept in a context, so any number of hashes can be computed at the same time,
+ * on any threads. hash_final returns the hash as a fingerprint (below).
+ */
+
+struct hash_ctx {
+	uint64_t acc[8] __attribute__((aligned(16)));
+	uint8_t buf[HASH_STRIPE];	/* incomplete stripe */
+	unsigned buffered;		/* bytes in "buf" */
+	unsigned stripes;		/* stripes since last scrambling */
+	uint64_t len;			/* total length */
+};
+
+/*
+ * Fingerprints are sums of the 128-bit hashes of their items. Items can
+ * therefore be added and removed in any order, without hashing the others
+ * again.
+ */
+
+struct fingerprint {
+	uint64_t lo, hi;
+};
+
+
+void hash_init(struct hash_ctx *ctx);
+void hash_update(struct hash_ctx *ctx, const void *data, size_t len);
+void hash_final(struct hash_ctx *ctx, struct fingerprint *h);
+
+void fingerprint_add(struct fingerprint *fp, const struct fingerprint *item);
+void fingerprint_sub(struct fingerprint *fp, const struct fingerprint *item);
+
+/* 32 hex digits */
+char *fingerprint_string(const struct fingerprint *fp);
+
+/*
+ * Fast, non-cryptographic 32-bit hashes (FNV-1a), for indexes. hash_str and
+ * hash_str_nocase hash a string. Hashes can also be built from several parts:
+ * start with FNV_OFFSET, and add strings with hash_str_continue, or other
+ * values with fnv_mix.
+ */
+
+#define	FNV_OFFSET	2166136261U
+#define	FNV_PRIME	16777619U
+
+static inline uint32_t fnv_mix(uint32_t h, uint32_t v)
+{
+	return (h ^ v) * FNV_PRIME;
+}
+
+uint32_t hash_str_continue(uint32_t h, const char *s);
+uint32_t hash_str(const char *s);
+uint32_t hash_str_nocase(const char *s);
 
 #endif /* !HASH_H */
@@ -0,0 +1,123 @@
+/*
+ * hashbench.c - Compare the speed of MD5 and the 128-bit hash
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <md5.h>
+
+#include "alloc.h"
+#include "hash.h"
+
+
+#define	TOTAL_BYTES	(256 * 1024 * 1024)
+
+
+static volatile uint64_t sink;
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static double run_md5(const uint8_t *buf, size_t size, unsigned n)
+{
+	uint8_t digest[MD5_DIGEST_LENGTH];
+	MD5_CTX ctx;
+	double t0 = now();
+	unsigned i;
+
+	for (i = 0; i != n; i++) {
+		MD5Init(&ctx);
+		MD5Update(&ctx, buf, size);
+		MD5Final(digest, &ctx);
+		sink += digest[0];
+	}
+	return now() - t0;
+}
+
+
+static double run_hash(const uint8_t *buf, size_t size, unsigned n)
+{
+	struct hash_ctx ctx;
+	struct fingerprint h;
+	double t0 = now();
+	unsigned i;
+
+	for (i = 0; i != n; i++) {
+		hash_init(&ctx);
+		hash_update(&ctx, buf, size);
+		hash_final(&ctx, &h);
+		sink += h.lo;
+	}
+	return now() - t0;
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [size ...]\n", name);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	static const size_t default_sizes[] = { 16, 64, 256, 4096, 65536 };
+	size_t sizes[argc > 1 ? argc - 1 : 5];
+	unsigned n_sizes, i, n;
+	uint8_t *buf;
+	size_t max = 0;
+
+	if (argc > 1) {
+		for (i = 1; i != (unsigned) argc; i++) {
+			char *end;
+
+			sizes[i - 1] = strtoul(argv[i], &end, 0);
+			if (*end || !sizes[i - 1])
+				usage(*argv);
+		}
+		n_sizes = argc - 1;
+	} else {
+		for (i = 0; i != 5; i++)
+			sizes[i] = default_sizes[i];
+		n_sizes = 5;
+	}
+	for (i = 0; i != n_sizes; i++)
+		if (sizes[i] > max)
+			max = sizes[i];
+
+	buf = alloc_size(max);
+	for (i = 0; i != max; i++)
+		buf[i] = i * 131 + 7;
+
+	printf("%10s %12s %12s %8s\n", "bytes", "MD5 MB/s", "hash MB/s",
+	    "speedup");
+	for (i = 0; i != n_sizes; i++) {
+		double t_md5, t_hash;
+
+		n = TOTAL_BYTES / sizes[i];
+		if (!n)
+			n = 1;
+		t_md5 = run_md5(buf, sizes[i], n);
+		t_hash = run_hash(buf, sizes[i], n);
+		printf("%10zu %12.1f %12.1f %7.1fx\n", sizes[i],
+		    (double) sizes[i] * n / t_md5 / 1e6,
+		    (double) sizes[i] * n / t_hash / 1e6, t_md5 / t_hash);
+	}
+	free(buf);
+	return 0;
+}
@@ -1,5 +1,5 @@
 /*
- * host.c - Host file parsing and lookup
+ * host.c - Host file loading and lookup
  *
  * Copyright (C) 2022 Linzhi Ltd.
  *
@@ -9,114 +9,433 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
-#include <errno.h>
+#include <pthread.h>
 
 #include "alloc.h"
 #include "bonanza.h"
 #include "error.h"
-#include "expr.h" /* for y.tab.h */
+#include "stamp.h"
+#include "hash.h"
+#include "loader.h"
+#include "gen.h"
 #include "host.h"
 
-#include "y.tab.h"
-
 
 struct host {
-	unsigned ipv4;
-	struct host_name *names;
-	struct host *next;
+	uint32_t ipv4;
+	unsigned prefix_len;	/* 32 for a single address */
+	unsigned first_name;	/* index into host_file.names */
+	unsigned n_names;
+};
+
+/*
+ * Path-compressed binary trie of address blocks. A node matches all addresses
+ * that begin with its prefix. "terminal" nodes correspond to blocks in the
+ * file, the others only join subtrees.
+ */
+
+struct block {
+	uint32_t prefix;
+	unsigned len;		/* < 32 */
+	bool terminal;
+	struct block *child[2];
+};
+
+struct name_slot {
+	uint32_t hash;
+	const char *name;	/* NULL if the slot is empty */
 };
 
 struct host_file {
 	const char *name;
+	struct stamp stamp;
+	char *arena;			/* all names */
 	struct host *hosts;
+	unsigned n_hosts;
+	const char **names;
+	unsigned n_names;
+
+	/* indexes, open addressing */
+	const struct host **addr_index;	/* single addresses */
+	unsigned addr_index_size;	/* power of two */
+	struct name_slot *name_index;
+	unsigned name_index_size;	/* power of two */
+	struct block *blocks;		/* address blocks */
+
+	unsigned error_line;		/* of the syntax error; 0 if none */
 	struct host_file *next;
 };
 
 
 static struct host_file *host_files = NULL;
-static struct host_file *current_host_file = NULL;
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct generations generations = GENERATIONS_INIT;
 
 
-/* ----- Host file --------------------------------------------------------- */
+/* ----- Address blocks ---------------------------------------------------- */
 
 
-static struct host_file *host_file(const char *name)
+static uint32_t prefix_mask(unsigned len)
 {
-	struct host_file *h;
-	FILE *file;
+	return len ? ~(uint32_t) 0 << (32 - len) : 0;
+}
 
-	for (h = host_files; h; h = h->next)
-		if (!strcmp(h->name, name))
-			return h;
 
-	file = fopen(name, "r");
-	if (!file) {
-		errorf("%s: %s", name, strerror(errno));
-		return NULL;
+static unsigned bit(uint32_t addr, unsigned pos)
+{
+	return addr >> (31 - pos) & 1;
+}
+
+
+static struct block *new_block(uint32_t prefix, unsigned len, bool terminal)
+{
+	struct block *b;
+
+	b = alloc_type(struct block);
+	b->prefix = prefix;
+	b->len = len;
+	b->terminal = terminal;
+	b->child[0] = b->child[1] = NULL;
+	return b;
+}
+
+
+static void add_block(struct block **anchor, uint32_t prefix, unsigned len)
+{
+	struct block *b, *split;
+	unsigned common, max;
+	uint32_t diff;
+
+	while ((b = *anchor)) {
+		max = b->len < len ? b->len : len;
+		diff = b->prefix ^ prefix;
+		common = diff ? __builtin_clz(diff) : 32;
+		if (common > max)
+			common = max;
+		if (common == b->len) {
+			if (len == b->len) {
+				b->terminal = 1;
+				return;
+			}
+			anchor = &b->child[bit(prefix, b->len)];
+			continue;
+		}
+
+		/* the new block diverges from b, or contains it */
+		split = new_block(prefix & prefix_mask(common), common, 0);
+		split->child[bit(b->prefix, common)] = b;
+		*anchor = split;
+		if (common == len) {
+			split->terminal = 1;
+			return;
+		}
+		anchor = &split->child[bit(prefix, common)];
 	}
+	*anchor = new_block(prefix, len, 1);
+}
 
-	h = alloc_type(struct host_file);
-	h->name = stralloc(name);
-	h->hosts = NULL;
-	h->next = host_files;
-	host_files = h;
 
-	current_host_file = h;
-	scan_hosts(file, name);
-	(void) yyparse();
-	(void) fclose(file);
+static bool in_blocks(const struct block *b, uint32_t addr)
+{
+	while (b && !((b->prefix ^ addr) & prefix_mask(b->len))) {
+		if (b->terminal)
+			return 1;
+		b = b->child[bit(addr, b->len)];
+	}
+	return 0;
+}
+
 
-	return h;
+static void free_blocks(struct block *b)
+{
+	if (!b)
+		return;
+	free_blocks(b->child[0]);
+	free_blocks(b->child[1]);
+	free(b);
 }
 
 
-void add_host(unsigned ipv4, struct host_name *names)
+/* ----- Indexes ----------------------------------------------------------- */
+
+
+static uint32_t hash_ipv4(uint32_t addr)
 {
-	struct host *h = alloc_type(struct host);
+	/* Knuth's multiplicative hash; spreads consecutive addresses */
+	return addr * 2654435761u;
+}
 
-	h->ipv4 = ipv4;
-	h->names = names;
-	h->next = current_host_file->hosts;
-	current_host_file->hosts = h;
+
+static unsigned index_size(unsigned n)
+{
+	unsigned size = 16;
+
+	while (size < 2 * n)
+		size <<= 1;
+	return size;
 }
 
 
-/* ----- Lookup ------------------------------------------------------------ */
+static void build_indexes(struct host_file *f)
+{
+	const struct host *h;
+	const char *name;
+	unsigned mask, i, j;
+	uint32_t hash;
+
+	f->addr_index_size = index_size(f->n_hosts);
+	f->addr_index = alloc_type_n(const struct host *, f->addr_index_size);
+	memset(f->addr_index, 0,
+	    sizeof(const struct host *) * f->addr_index_size);
+	f->name_index_size = index_size(f->n_names);
+	f->name_index = alloc_type_n(struct name_slot, f->name_index_size);
+	memset(f->name_index, 0, sizeof(struct name_slot) * f->name_index_size);
+	f->blocks = NULL;
+
+	for (h = f->hosts; h != f->hosts + f->n_hosts; h++) {
+		if (h->prefix_len < 32) {
+			add_block(&f->blocks, h->ipv4, h->prefix_len);
+			continue;
+		}
+		mask = f->addr_index_size - 1;
+		for (i = hash_ipv4(h->ipv4) & mask; f->addr_index[i];
+		    i = (i + 1) & mask)
+			if (f->addr_index[i]->ipv4 == h->ipv4)
+				break;
+		f->addr_index[i] = h;
+	}
+	for (j = 0; j != f->n_names; j++) {
+		name = f->names[j];
+		hash = hash_str_nocase(name);
+		mask = f->name_index_size - 1;
+		for (i = hash & mask; f->name_index[i].name; i = (i + 1) & mask)
+			if (f->name_index[i].hash == hash &&
+			    !strcasecmp(f->name_index[i].name, name))
+				break;
+		f->name_index[i].hash = hash;
+		f->name_index[i].name = name;
+	}
+}
 
 
-bool file_contains_ipv4(const char *name, unsigned ipv4)
+/* ----- Loading ----------------------------------------------------------- */
+
+
+/*
+ * Each line contains an address (or address block) followed by one or more
+ * names. Empty lines are ignored. If we encounter a syntax error, we report
+ * it, and keep what we have so far.
+ */
+
+static void load_hosts(struct host_file *f, struct loader *ld)
+{
+	unsigned hosts_size = 0, names_size = 0;
+	struct host *h = NULL;
+	enum token tok;
+	const char *s;
+	uint32_t ipv4;
+	unsigned prefix_len;
+
+	while (1) {
+		tok = hosts_token(ld, &s, &ipv4, &prefix_len);
+		if (tok == tok_addr && !h) {
+			if (f->n_hosts == hosts_size) {
+				hosts_size = hosts_size ? hosts_size * 2 : 64;
+				f->hosts = realloc_type_n(f->hosts, hosts_size);
+			}
+			h = f->hosts + f->n_hosts++;
+			h->ipv4 = ipv4 & prefix_mask(prefix_len);
+			h->prefix_len = prefix_len;
+			h->first_name = f->n_names;
+			h->n_names = 0;
+			continue;
+		}
+		if (tok == tok_host && h) {
+			if (f->n_names == names_size) {
+				names_size = names_size ? names_size * 2 : 64;
+				f->names = realloc_type_n(f->names, names_size);
+			}
+			f->names[f->n_names++] = s;
+			h->n_names++;
+			continue;
+		}
+		if (tok != tok_nl && tok != tok_eof)
+			break;
+		if (h && !h->n_names)
+			break;
+		if (tok == tok_eof)
+			return;
+		h = NULL;
+	}
+	loader_syntax_error(ld);
+}
+
+
+static void free_host_file(struct host_file *f)
+{
+	free((void *) f->name);
+	stamp_free(&f->stamp);
+	free(f->addr_index);
+	free(f->name_index);
+	free_blocks(f->blocks);
+	free(f->hosts);
+	free(f->names);
+	free(f->arena);
+	free(f);
+}
+
+
+/* call with host_lock held */
+
+static struct host_file *find_host_file(const char *name)
+{
+	struct host_file *f;
+
+	for (f = host_files; f; f = f->next)
+		if (!strcmp(f->name, name))
+			return f;
+	return NULL;
+}
+
+
+/* see map_file */
+
+static struct host_file *host_file(const char *name)
+{
+	struct host_file *f, *old;
+	struct loader ld;
+
+	pthread_mutex_lock(&host_lock);
+	f = find_host_file(name);
+	pthread_mutex_unlock(&host_lock);
+	if (f)
+		return f;
+
+	if (!loader_open(&ld, name))
+		return NULL;
+
+	f = alloc_type(struct host_file);
+	f->name = stralloc(name);
+	stamp_init(&f->stamp, name);
+	f->hosts = NULL;
+	f->n_hosts = 0;
+	f->names = NULL;
+	f->n_names = 0;
+
+	load_hosts(f, &ld);
+	f->error_line = ld.error_line;
+	f->arena = loader_close(&ld);
+	build_indexes(f);
+
+	pthread_mutex_lock(&host_lock);
+	old = find_host_file(name);
+	if (old) {
+		pthread_mutex_unlock(&host_lock);
+		free_host_file(f);
+		return old;
+	}
+	f->next = host_files;
+	host_files = f;
+	pthread_mutex_unlock(&host_lock);
+
+	return f;
+}
+
+
+/* see preload_map_file */
+
+bool preload_host_file(const char *name)
 {
 	const struct host_file *f;
+
+	pthread_mutex_lock(&host_lock);
+	f = find_host_file(name);
+	pthread_mutex_unlock(&host_lock);
+	if (f) {
+		if (f->error_line)
+			errorf("%s:%u: syntax error", name, f->error_line);
+	} else {
+		f = host_file(name);
+		if (!f)
+			return 0;
+	}
+	return !f->error_line;
+}
+
+
+/* ----- Lookup ------------------------------------------------------------ */
+
+
+bool host_file_contains_ipv4(const struct host_file *f, unsigned ipv4)
+{
 	const struct host *h;
+	unsigned mask, i;
 
-	f = host_file(name);
-	if (!f)
-		return 0;
-	for (h = f->hosts; h; h = h->next)
+	mask = f->addr_index_size - 1;
+	for (i = hash_ipv4(ipv4) & mask; (h = f->addr_index[i]);
+	    i = (i + 1) & mask)
 		if (h->ipv4 == ipv4)
 			return 1;
+	return in_blocks(f->blocks, ipv4);
+}
+
+
+bool host_file_contains_name(const struct host_file *f, const char *host)
+{
+	const struct name_slot *slot;
+	unsigned mask, i;
+	uint32_t hash;
+
+	hash = hash_str_nocase(host);
+	mask = f->name_index_size - 1;
+	for (i = hash & mask; (slot = f->name_index + i)->name;
+	    i = (i + 1) & mask)
+		if (slot->hash == hash && !strcasecmp(slot->name, host))
+			return 1;
 	return 0;
 }
 
 
+bool file_contains_ipv4(const char *name, unsigned ipv4)
+{
+	const struct host_file *f;
+
+	f = host_file(name);
+	return f && host_file_contains_ipv4(f, ipv4);
+}
+
+
 bool file_contains_name(const char *name, const char *host)
 {
 	const struct host_file *f;
-	const struct host *h;
-	const struct host_name *n;
 
 	f = host_file(name);
-	if (!f)
-		return 0;
-	for (h = f->hosts; h; h = h->next)
-		for (n = h->names; n; n = n->next)
-			if (!strcasecmp(n->name, host))
-				return 1;
-	return 0;
+	return f && host_file_contains_name(f, host);
+}
+
+
+/* ----- Binding ----------------------------------------------------------- */
+
+
+const struct host_file *host_file_loaded(const char *name)
+{
+	const struct host_file *f;
+
+	pthread_mutex_lock(&host_lock);
+	f = find_host_file(name);
+	pthread_mutex_unlock(&host_lock);
+	return f;
+}
+
+
+const struct generation *host_files_generation(const char *name)
+{
+	return generation_of(&generations, name);
 }
 
 
@@ -127,17 +446,19 @@ void dump_host_files(void)
 {
 	const struct host_file *f;
 	const struct host *h;
-	const struct host_name *n;
+	unsigned i;
 
 	for (f = host_files; f; f = f->next) {
 		printf("### %s:\n", f->name);
-		for (h = f->hosts; h; h = h->next) {
+		for (h = f->hosts; h != f->hosts + f->n_hosts; h++) {
 			printf("%d.%d.%d.%d",
 			    h->ipv4 >> 24, (h->ipv4 >> 16) & 255,
 			    (h->ipv4 >> 8) & 255, h->ipv4 & 255);
-			for (n = h->names; n; n = n->next)
-				printf("%c%s",
-				    n == h->names ? '\t' : ' ', n->name);
+			if (h->prefix_len < 32)
+				printf("/%u", h->prefix_len);
+			for (i = 0; i != h->n_names; i++)
+				printf("%c%s", i ? ' ' : '\t',
+				    f->names[h->first_name + i]);
 			printf("\n");
 		}
 	}
@@ -147,29 +468,28 @@ void dump_host_files(void)
 /* ----- Cleanup ----------------------------------------------------------- */
 
 
-static void free_host(struct host *h)
-{
-	while (h->names) {
-		struct host_name *n = h->names;
-
-		h->names = n->next;
-		free(n->name);
-		free(n);
-	}
-	free(h);
-}
-
-
-static void free_host_file(struct host_file *f)
+bool expire_host_files(const char *dir)
 {
-	free((void *) f->name);
-	while (f->hosts) {
-		struct host *h = f->hosts;
-
-		f->hosts = h->next;
-		free_host(h);
+	struct host_file **anchor = &host_files;
+	size_t len = strlen(dir);
+	bool expired = 0;
+
+	pthread_mutex_lock(&host_lock);
+	while (*anchor) {
+		struct host_file *f = *anchor;
+
+		if (!strncmp(f->name, dir, len) && f->name[len] == '/' &&
+		    stamp_changed(&f->stamp, f->name)) {
+			*anchor = f->next;
+			generation_bump(&generations, f->name);
+			free_host_file(f);
+			expired = 1;
+		} else {
+			anchor = &f->next;
+		}
 	}
-	free(f);
+	pthread_mutex_unlock(&host_lock);
+	return expired;
 }
 
 
@@ -181,5 +501,6 @@ void free_host_files(void)
 		host_files = f->next;
 		free_host_file(f);
 	}
+	generation_bump_all(&generations);
 }
 
@@ -1,5 +1,5 @@
 /*
- * host.h - Host file parsing and lookup
+ * host.h - Host file loading and lookup
  *
  * Copyright (C) 2022 Linzhi Ltd.
  *
@@ -13,19 +13,26 @@
 #include <stdbool.h>
 
 
-struct host_name {
-	char *name;
-	struct host_name *next;
-};
+struct host_file;
+struct generation;
 
 
 bool file_contains_ipv4(const char *name, unsigned ipv4);
 bool file_contains_name(const char *name, const char *host);
 
-void dump_host_files(void);
+/* see map_file_loaded */
+const struct host_file *host_file_loaded(const char *name);
+bool host_file_contains_ipv4(const struct host_file *f, unsigned ipv4);
+bool host_file_contains_name(const struct host_file *f, const char *host);
+const struct generation *host_files_generation(const char *name);
+
+/* see preload_map_file */
+bool preload_host_file(const char *name);
 
-void add_host(unsigned ipv4, struct host_name *names);
+void dump_host_files(void);
 
+/* see expire_map_files */
+bool expire_host_files(const char *dir);
 void free_host_files(void);
 
 #endif /* !HOST_H */
@@ -0,0 +1,212 @@
+/*
+ * infer.c - Type inference and specialization of comparisons
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * compare() evaluates both operands and then decides at run time whether to
+ * compare numerically or as strings. Most comparisons have a constant on one
+ * side, e.g., ip == 10.1.2.3 or NAME == "foo". We rewrite them into nodes that
+ * compare directly against the constant.
+ *
+ * If the constant is a number, the comparison is numeric if the other operand
+ * turns out to be a number, too. If we can infer that the other operand is
+ * always a string, we can use a plain string comparison instead.
+ *
+ * Variables that are not set by the rules are strings (from the miner's
+ * configuration, or "" if unset), except for the script variables "id" and
+ * "ip", which are numbers (see initialize_vars in miner.c). Assignments in the
+ * rules add the type of the value assigned.
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "expr.h"
+#include "exec.h"
+#include "infer.h"
+
+
+enum type {
+	t_num	= 1 << 0,
+	t_str	= 1 << 1,
+	t_any	= t_num | t_str,
+};
+
+struct var_type {
+	const char *name;
+	bool cfg;
+	enum type type;
+	struct var_type *next;
+};
+
+struct specialization {
+	bool (*op)(const struct bool_expr *self, const struct exec_env *exec);
+	bool (*num)(const struct bool_expr *self, const struct exec_env *exec);
+	bool (*str)(const struct bool_expr *self, const struct exec_env *exec);
+	bool (*mirror)(const struct bool_expr *self,
+	    const struct exec_env *exec);	/* for a OP b -> b MIRROR a */
+};
+
+
+static const struct specialization specializations[] = {
+	{ op_eq, op_eq_num, op_eq_str, op_eq },
+	{ op_ne, op_ne_num, op_ne_str, op_ne },
+	{ op_lt, op_lt_num, op_lt_str, op_gt },
+	{ op_le, op_le_num, op_le_str, op_ge },
+	{ op_gt, op_gt_num, op_gt_str, op_lt },
+	{ op_ge, op_ge_num, op_ge_str, op_le },
+	{ NULL, NULL, NULL, NULL }
+};
+
+
+/* ----- Variable types ---------------------------------------------------- */
+
+
+static struct var_type *find_var(struct var_type **types, const char *name,
+    bool cfg)
+{
+	struct var_type *t;
+
+	for (t = *types; t; t = t->next)
+		if (t->cfg == cfg && !strcmp(t->name, name))
+			return t;
+	t = alloc_type(struct var_type);
+	t->name = name;
+	t->cfg = cfg;
+	t->type = !cfg && (!strcmp(name, "id") || !strcmp(name, "ip")) ?
+	    t_num : t_str;
+	t->next = *types;
+	*types = t;
+	return t;
+}
+
+
+static enum type expr_type(struct var_type **types, const struct expr *e)
+{
+	struct value *(*op)(const struct expr *self,
+	    const struct exec_env *exec) = e->op;
+
+	if (op == op_num)
+		return t_num;
+	if (op == op_string || op == op_map)
+		return t_str;
+	if (op == op_concat)
+		return expr_type(types, e->a.exprs[0]);
+	if ((op == op_cfg || op == op_var) && !e->key)
+		return find_var(types, e->a.s, op == op_cfg)->type;
+	return t_any;
+}
+
+
+/*
+ * Keyed assignments create elements of associative arrays, which are distinct
+ * from plain variables, so they don't affect the type of the latter.
+ */
+
+static bool assign_types(struct var_type **types, const struct rule *rules)
+{
+	const struct rule *r;
+	const struct setting *s;
+	bool changed = 0;
+
+	for (r = rules; r; r = r->next)
+		for (s = r->settings; s; s = s->next) {
+			struct var_type *t;
+			enum type type;
+
+			if (s->op != set_cfg && s->op != set_var)
+				continue;
+			if (s->key)
+				continue;
+			type = expr_type(types, s->expr);
+			t = find_var(types, s->name, s->op == set_cfg);
+			if ((t->type | type) != t->type) {
+				t->type |= type;
+				changed = 1;
+			}
+		}
+	return changed;
+}
+
+
+static void free_types(struct var_type *types)
+{
+	struct var_type *next;
+
+	while (types) {
+		next = types->next;
+		free(types);
+		types = next;
+	}
+}
+
+
+/* ----- Specialization ---------------------------------------------------- */
+
+
+static bool is_constant(const struct expr *e)
+{
+	return e->op == op_num || e->op == op_string;
+}
+
+
+static void specialize(struct var_type **types, struct bool_expr *e)
+{
+	const struct specialization *sp;
+	struct expr *tmp;
+
+	if (e->op == op_or || e->op == op_and) {
+		specialize(types, e->a.bool_expr);
+		specialize(types, e->b.bool_expr);
+		return;
+	}
+	if (e->op == op_not) {
+		specialize(types, e->a.bool_expr);
+		return;
+	}
+
+	for (sp = specializations; sp->op; sp++)
+		if (sp->op == e->op)
+			break;
+	if (!sp->op)
+		return;
+	if (is_constant(e->a.expr) == is_constant(e->b.expr))
+		return;
+
+	/* put the constant on the right side */
+	if (is_constant(e->a.expr)) {
+		tmp = e->a.expr;
+		e->a.expr = e->b.expr;
+		e->b.expr = tmp;
+		e->op = sp->mirror;
+		for (sp = specializations; sp->op != e->op; sp++)
+			;
+	}
+	if (e->b.expr->op == op_num &&
+	    expr_type(types, e->a.expr) != t_str)
+		e->op = sp->num;
+	else
+		e->op = sp->str;
+}
+
+
+void specialize_rules(struct rule *rules)
+{
+	struct var_type *types = NULL;
+	struct rule *r;
+
+	while (assign_types(&types, rules))
+		;
+	for (r = rules; r; r = r->next)
+		if (r->cond)
+			specialize(&types, r->cond);
+	free_types(types);
+}
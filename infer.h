@@ -0,0 +1,18 @@
+/*
+ * infer.h - Type inference and specialization of comparisons
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef INFER_H
+#define	INFER_H
+
+#include "exec.h"
+
+
+void specialize_rules(struct rule *rules);
+
+#endif /* !INFER_H */
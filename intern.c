@@ -0,0 +1,150 @@
+/*
+ * intern.c - Pool of shared strings
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "alloc.h"
+#include "hash.h"
+#include "intern.h"
+
+
+#define	INITIAL_BUCKETS	256
+
+
+struct istr {
+	unsigned refs;
+	uint32_t hash;
+	size_t len;
+	struct istr *chain;	/* next in hash bucket */
+	char s[];
+};
+
+
+static struct istr **buckets = NULL;
+static unsigned n_buckets = 0;
+static unsigned n_strings = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ----- Hash table -------------------------------------------------------- */
+
+
+static struct istr *istr(const char *s)
+{
+	return (struct istr *) (s - offsetof(struct istr, s));
+}
+
+
+static struct istr **bucket(uint32_t hash)
+{
+	return buckets + (hash & (n_buckets - 1));
+}
+
+
+static void grow(void)
+{
+	struct istr **old = buckets;
+	unsigned n_old = n_buckets;
+	struct istr *is, *next, **b;
+	unsigned i;
+
+	n_buckets = n_old ? n_old * 2 : INITIAL_BUCKETS;
+	buckets = alloc_type_n(struct istr *, n_buckets);
+	memset(buckets, 0, sizeof(struct istr *) * n_buckets);
+	for (i = 0; i != n_old; i++)
+		for (is = old[i]; is; is = next) {
+			next = is->chain;
+			b = bucket(is->hash);
+			is->chain = *b;
+			*b = is;
+		}
+	free(old);
+}
+
+
+/* ----- References -------------------------------------------------------- */
+
+
+const char *intern(const char *s)
+{
+	uint32_t hash = hash_str_nocase(s);
+	size_t len = strlen(s);
+	struct istr *is, **b;
+
+	pthread_mutex_lock(&lock);
+	if (n_buckets)
+		for (is = *bucket(hash); is; is = is->chain)
+			if (is->hash == hash && is->len == len &&
+			    !memcmp(is->s, s, len)) {
+				is->refs++;
+				pthread_mutex_unlock(&lock);
+				return is->s;
+			}
+	if (n_strings == n_buckets)
+		grow();
+	is = alloc_size(sizeof(struct istr) + len + 1);
+	is->refs = 1;
+	is->hash = hash;
+	is->len = len;
+	memcpy(is->s, s, len + 1);
+	b = bucket(hash);
+	is->chain = *b;
+	*b = is;
+	n_strings++;
+	pthread_mutex_unlock(&lock);
+	return is->s;
+}
+
+
+const char *intern_ref(const char *s)
+{
+	pthread_mutex_lock(&lock);
+	istr(s)->refs++;
+	pthread_mutex_unlock(&lock);
+	return s;
+}
+
+
+void intern_put(const char *s)
+{
+	struct istr *is, **anchor;
+
+	if (!s)
+		return;
+	is = istr(s);
+	pthread_mutex_lock(&lock);
+	if (!--is->refs) {
+		for (anchor = bucket(is->hash); *anchor != is;
+		    anchor = &(*anchor)->chain)
+			;
+		*anchor = is->chain;
+		n_strings--;
+		free(is);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+/* ----- Properties -------------------------------------------------------- */
+
+
+uint32_t intern_hash(const char *s)
+{
+	return istr(s)->hash;
+}
+
+
+size_t intern_len(const char *s)
+{
+	return istr(s)->len;
+}
@@ -0,0 +1,36 @@
+/*
+ * intern.h - Pool of shared strings
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef INTERN_H
+#define	INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * intern returns a string from the pool with the same content as "s", adding
+ * it to the pool if necessary. Strings in the pool are unique, so strings
+ * from the pool are equal if and only if their pointers are.
+ *
+ * Strings in the pool are reference-counted. intern and intern_ref add a
+ * reference, intern_put drops one. intern_hash (hash_str_nocase of the
+ * string) and intern_len are precomputed.
+ *
+ * The pool can be used from any thread.
+ */
+
+const char *intern(const char *s);
+const char *intern_ref(const char *s);
+void intern_put(const char *s);
+
+uint32_t intern_hash(const char *s);
+size_t intern_len(const char *s);
+
+#endif /* !INTERN_H */
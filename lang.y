@@ -1,5 +1,5 @@
 /*
- * lang.y - Parser for rules, host, and map files
+ * lang.y - Parser for rules files
  *
  * Copyright (C) 2022, 2023 Linzhi Ltd.
  *
@@ -17,8 +17,6 @@
 #include "validate.h"
 #include "expr.h"
 #include "exec.h"
-#include "host.h"
-#include "map.h"
 #include "bonanza.h"
 %}
 
@@ -38,16 +36,10 @@
 	struct setting *setting;
 	struct list *list;
 	struct list *list_item;
-
-	struct {
-		struct host_name *first;
-		struct host_name *last;
-	} host_names;
-	struct host_name *host_name;
 };
 
 
-%token			START_RULES START_HOSTS START_MAP
+%locations
 
 %token			NOINDENT
 %token			TOK_NOT TOK_AND TOK_OR TOK_IN
@@ -63,23 +55,8 @@
 %type	<settings>	settings
 %type	<setting>	setting
 
-%token			NL
-%token	<s>		HOST
-%type	<host_name>	host_name
-%type	<host_names>	host_names
-
 %%
 
-all:
-	START_RULES rules_file
-	| START_HOSTS hosts_file
-	| START_MAP map_file
-	;
-
-
-/* ===== Rules file ======================================================== */
-
-
 rules_file:
 	| first_rule
 	| first_rule more_rules
@@ -94,11 +71,11 @@ more_rules:
 first_rule:
 	settings
 		{
-			add_rule(NULL, $1.first);
+			add_rule(NULL, $1.first, @1.first_line);
 		}
 	| condition ':' settings
 		{
-			add_rule($1, $3.first);
+			add_rule($1, $3.first, @1.first_line);
 		}
 	;
 
@@ -253,11 +230,13 @@ list_item:
 settings:
 	setting
 		{
+			$1->lineno = @1.first_line;
 			$$.first = $1;
 			$$.last = $1;
 		}
 	| settings setting
 		{
+			$2->lineno = @2.first_line;
 			$$.first = $1.first;
 			$1.last->next = $2;
 			$$.last = $2;
@@ -317,9 +296,7 @@ value_expression:
 		}
 	| value_expression '+' primary_expression
 		{
-			$$ = new_op(op_concat);
-			$$->a.expr = $1;
-			$$->b.expr = $3;
+			$$ = new_concat($1, $3);
 		}
 	;
 
@@ -367,78 +344,3 @@ primary_expression:
 		}
 	;
 
-
-/* ===== Hosts file ======================================================== */
-
-
-hosts_file:
-	| nls
-	| more_hosts opt_nls
-	| nls more_hosts nls
-	;
-
-more_hosts:
-	host_line
-	| more_hosts nls host_line
-	;
-
-host_line:
-	IPv4 host_names
-		{
-			add_host($1.n, $2.first);
-		}
-	;
-
-opt_nls:
-	| nls
-	;
-
-nls:
-	NL
-	| nls NL
-	;
-
-host_names:
-	host_name
-		{
-			$$.first = $1;
-			$$.last = $1;
-		}
-	| host_names host_name
-		{
-			$$.first = $1.first;
-			$1.last->next = $2;
-			$$.last = $2;
-		}
-	;
-
-host_name:
-	HOST
-		{
-			$$ = alloc_type(struct host_name);
-			$$->name = $1;
-			$$->next = NULL;
-		}
-	;
-
-
-/* ===== Map file ========================================================== */
-
-
-map_file:
-	| nls
-	| more_mappings opt_nls
-	| nls more_mappings nls
-	;
-
-more_mappings:
-	mapping_line
-	| more_mappings nls mapping_line
-	;
-
-mapping_line:
-	STRING STRING
-		{
-			add_mapping($1, $2);
-		}
-	;
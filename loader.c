@@ -0,0 +1,404 @@
+/*
+ * loader.c - Tokenizer for map and host files
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * Map and host files can be very large. Instead of going through the lexer and
+ * parser used for rules, we map the file into memory and tokenize it directly,
+ * copying all strings into a single arena.
+ *
+ * The tokenizers follow the lexical rules of the MAP and HOSTS states the
+ * lexer used to have, including flex's longest-match rule:
+ *
+ * Map files: strings are quoted with " or ', or consist of any characters
+ * except blanks and newlines (but can't begin with #). If a quoted and an
+ * unquoted string match, the longer one wins, and the quoted one on a tie.
+ *
+ * Host files: IPv4 addresses (dotted quads) with an optional /prefix length,
+ * and host names (labels of up to 63 letters, digits, or dashes, separated by
+ * dots). Again, the longest match wins, and addresses win ties.
+ *
+ * In both, # begins a comment that extends to the end of the line.
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "alloc.h"
+#include "error.h"
+#include "loader.h"
+
+
+#define	HOST_ELEM_MAX	63
+
+
+/* ----- Open and close ---------------------------------------------------- */
+
+
+bool loader_open(struct loader *ld, const char *name)
+{
+	struct stat st;
+	void *buf = NULL;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		errorf("%s: %s", name, strerror(errno));
+		return 0;
+	}
+	if (fstat(fd, &st) < 0) {
+		errorf("%s: %s", name, strerror(errno));
+		(void) close(fd);
+		return 0;
+	}
+	if (st.st_size) {
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) {
+			errorf("%s: %s", name, strerror(errno));
+			(void) close(fd);
+			return 0;
+		}
+		(void) posix_madvise(buf, st.st_size, POSIX_MADV_SEQUENTIAL);
+	}
+	(void) close(fd);
+
+	ld->name = name;
+	ld->buf = buf;
+	ld->size = st.st_size;
+	ld->pos = buf;
+	ld->lineno = 1;
+	ld->error_line = 0;
+
+	/*
+	 * Every token is followed by at least one character we don't copy
+	 * (blank, newline, quote, etc.), which leaves room for its NUL, except
+	 * at the end of the file, and where a host name is split because a
+	 * label exceeds its maximum length.
+	 */
+	ld->arena = alloc_size(ld->size + ld->size / HOST_ELEM_MAX + 2);
+	ld->next = ld->arena;
+	return 1;
+}
+
+
+char *loader_close(struct loader *ld)
+{
+	if (ld->size)
+		(void) munmap((void *) ld->buf, ld->size);
+	return ld->arena;
+}
+
+
+char *loader_keep(struct loader *ld)
+{
+	return ld->arena;
+}
+
+
+void loader_syntax_error(struct loader *ld)
+{
+	ld->error_line = ld->lineno;
+	errorf("%s:%u: syntax error", ld->name, ld->lineno);
+}
+
+
+/* ----- Common helpers ---------------------------------------------------- */
+
+
+static size_t left(const struct loader *ld)
+{
+	return ld->buf + ld->size - ld->pos;
+}
+
+
+static const char *store(struct loader *ld, const char *s, size_t len)
+{
+	char *res = ld->next;
+
+	memcpy(res, s, len);
+	res[len] = 0;
+	ld->next += len + 1;
+	return res;
+}
+
+
+static void count_lines(struct loader *ld, const char *s, size_t len)
+{
+	const char *end = s + len;
+
+	while ((s = memchr(s, '\n', end - s))) {
+		ld->lineno++;
+		s++;
+	}
+}
+
+
+/*
+ * Skip blanks and comments. Then return tok_eof or tok_nl if we're at the end
+ * of the file or a line, or tok_other if there's a token to parse.
+ */
+
+static enum token skip(struct loader *ld)
+{
+	const char *nl;
+
+	while (left(ld)) {
+		switch (*ld->pos) {
+		case ' ':
+		case '\t':
+			ld->pos++;
+			break;
+		case '#':
+			nl = memchr(ld->pos, '\n', left(ld));
+			ld->pos = nl ? nl : ld->buf + ld->size;
+			break;
+		case '\n':
+			while (left(ld) && *ld->pos == '\n') {
+				ld->lineno++;
+				ld->pos++;
+			}
+			return tok_nl;
+		default:
+			return tok_other;
+		}
+	}
+	return tok_eof;
+}
+
+
+/* ----- Map files --------------------------------------------------------- */
+
+
+enum token map_token(struct loader *ld, const char **s)
+{
+	const char *p, *close;
+	size_t plain = 0, quoted = 0;
+	enum token tok;
+
+	tok = skip(ld);
+	if (tok != tok_other)
+		return tok;
+
+	p = ld->pos;
+	while (plain != left(ld) && p[plain] != ' ' && p[plain] != '\t' &&
+	    p[plain] != '\n')
+		plain++;
+	if (*p == '"' || *p == '\'') {
+		close = memchr(p + 1, *p, left(ld) - 1);
+		if (close)
+			quoted = close - p + 1;
+	}
+	if (quoted && quoted >= plain) {
+		*s = store(ld, p + 1, quoted - 2);
+		count_lines(ld, p, quoted);
+		ld->pos += quoted;
+	} else {
+		*s = store(ld, p, plain);
+		ld->pos += plain;
+	}
+	return tok_string;
+}
+
+
+/* ----- Host files -------------------------------------------------------- */
+
+
+static bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+
+static bool is_alnum(char c)
+{
+	return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+
+static size_t match_host_elem(const char *p, size_t left)
+{
+	size_t n;
+
+	if (!left || !is_alnum(*p))
+		return 0;
+	for (n = 1; n != HOST_ELEM_MAX && n != left; n++)
+		if (!is_alnum(p[n]) && p[n] != '-')
+			break;
+	return n;
+}
+
+
+static size_t match_host(const char *p, size_t left)
+{
+	size_t len, elem;
+
+	len = match_host_elem(p, left);
+	if (!len)
+		return 0;
+	while (len + 1 < left && p[len] == '.') {
+		elem = match_host_elem(p + len + 1, left - len - 1);
+		if (!elem)
+			break;
+		len += 1 + elem;
+	}
+	return len;
+}
+
+
+static size_t digits(const char *p, size_t left)
+{
+	size_t n = 0;
+
+	while (n != left && is_digit(p[n]))
+		n++;
+	return n;
+}
+
+
+/* decimal 0-255, without leading zeroes */
+
+static bool is_byte(const char *p, size_t len, unsigned *value)
+{
+	unsigned v = 0;
+	size_t i;
+
+	if (!len || len > 3 || (len > 1 && *p == '0'))
+		return 0;
+	for (i = 0; i != len; i++)
+		v = v * 10 + p[i] - '0';
+	*value = v;
+	return v < 256;
+}
+
+
+/*
+ * Match the first three bytes of a dotted quad, including the dot after each
+ * of them. Return the length matched, or 0 if there's no match.
+ */
+
+static size_t match_ipv4_head(const char *p, size_t left, uint32_t *ipv4)
+{
+	size_t len = 0, n;
+	unsigned i, byte;
+
+	*ipv4 = 0;
+	for (i = 0; i != 3; i++) {
+		n = digits(p + len, left - len);
+		if (!is_byte(p + len, n, &byte))
+			return 0;
+		len += n;
+		if (len == left || p[len] != '.')
+			return 0;
+		len++;
+		*ipv4 = *ipv4 << 8 | byte;
+	}
+	return len;
+}
+
+
+/* a token of length "len" is followed by a blank, a newline, or the end */
+
+static bool token_end(const struct loader *ld, size_t len)
+{
+	return len == left(ld) || ld->pos[len] == ' ' ||
+	    ld->pos[len] == '\t' || ld->pos[len] == '\n';
+}
+
+
+/*
+ * Parse the prefix length of an address block, after the slash. Return the
+ * length of the block, or 0 if the prefix length is missing, has leading
+ * zeroes, is above 32, or is followed by anything but a blank, a newline, or
+ * the end of the file.
+ */
+
+static size_t match_prefix_len(const struct loader *ld, size_t slash,
+    unsigned *prefix_len)
+{
+	const char *q = ld->pos + slash + 1;
+	size_t n = digits(q, left(ld) - slash - 1);
+	unsigned plen = 0;
+	size_t i;
+
+	if (!n || (n > 1 && *q == '0'))
+		return 0;
+	for (i = 0; i != n && plen <= 32; i++)
+		plen = plen * 10 + q[i] - '0';
+	if (plen > 32 || !token_end(ld, slash + 1 + n))
+		return 0;
+	*prefix_len = plen;
+	return slash + 1 + n;
+}
+
+
+enum token hosts_token(struct loader *ld, const char **s, uint32_t *ipv4,
+    unsigned *prefix_len)
+{
+	const char *p;
+	size_t host, addr = 0, block;
+	size_t head, n, k;
+	uint32_t a;
+	unsigned byte, last = 0, plen;
+	enum token tok;
+
+	tok = skip(ld);
+	if (tok != tok_other)
+		return tok;
+
+	p = ld->pos;
+	host = match_host(p, left(ld));
+	head = match_ipv4_head(p, left(ld), &a);
+	if (head) {
+		n = digits(p + head, left(ld) - head);
+
+		/* dotted quad: the longest byte we can get */
+		for (k = n < 3 ? n : 3; k; k--)
+			if (is_byte(p + head, k, &byte)) {
+				addr = head + k;
+				last = byte;
+				break;
+			}
+
+		/*
+		 * Address block: the whole number, slash, 0-32. Host names
+		 * can't contain a slash, so anything else is an error.
+		 */
+		if (is_byte(p + head, n, &byte) && head + n != left(ld) &&
+		    p[head + n] == '/') {
+			block = match_prefix_len(ld, head + n, &plen);
+			if (!block)
+				return tok_other;
+			*ipv4 = a << 8 | byte;
+			*prefix_len = plen;
+			ld->pos += block;
+			return tok_addr;
+		}
+		if (addr && addr >= host) {
+			*ipv4 = a << 8 | last;
+			*prefix_len = 32;
+			ld->pos += addr;
+			return tok_addr;
+		}
+	}
+	if (host) {
+		*s = store(ld, p, host);
+		ld->pos += host;
+		return tok_host;
+	}
+	ld->pos++;
+	return tok_other;
+}
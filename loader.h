@@ -0,0 +1,59 @@
+/*
+ * loader.h - Tokenizer for map and host files
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LOADER_H
+#define	LOADER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+enum token {
+	tok_eof,
+	tok_nl,		/* one or more newlines */
+	tok_string,	/* map file: key or value */
+	tok_addr,	/* host file: IPv4 address or address block */
+	tok_host,	/* host file: host name */
+	tok_other,	/* anything else; a syntax error */
+};
+
+struct loader {
+	const char *name;
+	const char *buf;	/* file content (mmap'ed) */
+	size_t size;
+	const char *pos;	/* next character to process */
+	unsigned lineno;
+	char *arena;		/* strings of all tokens */
+	char *next;		/* next free byte in arena */
+	unsigned error_line;	/* line of the syntax error; 0 if none */
+};
+
+
+/*
+ * loader_open maps the file and allocates a string arena large enough for all
+ * the tokens. On failure, it reports an error and returns 0. loader_close
+ * unmaps the file and returns the arena, which the caller then owns.
+ * loader_keep is like loader_close, but leaves the file mapped. The caller
+ * then owns the mapping, too, and unmaps it with munmap(buf, size).
+ *
+ * Strings returned by the tokenizers point into the arena.
+ */
+
+bool loader_open(struct loader *ld, const char *name);
+char *loader_close(struct loader *ld);
+char *loader_keep(struct loader *ld);
+
+enum token map_token(struct loader *ld, const char **s);
+enum token hosts_token(struct loader *ld, const char **s, uint32_t *ipv4,
+    unsigned *prefix_len);
+
+void loader_syntax_error(struct loader *ld);
+
+#endif /* !LOADER_H */
@@ -1,5 +1,5 @@
 /*
- * map.c - Map file parsing and lookup
+ * map.c - Map file loading and lookup
  *
  * Copyright (C) 2022 Linzhi Ltd.
  *
@@ -9,101 +9,543 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "alloc.h"
 #include "error.h"
-#include "bonanza.h"
-#include "expr.h" /* for y.tab.h */
+#include "stamp.h"
+#include "hash.h"
+#include "loader.h"
+#include "gen.h"
 #include "map.h"
 
-#include "y.tab.h"
+
+/*
+ * Compiled map files (see bonanza-mapc) begin with a header, followed by the
+ * hash table, followed by the records. All numbers are 32 bit little-endian.
+ *
+ * Header:	magic (16 bytes), number of records, number of slots
+ * Slot:	hash_str_nocase of the key, offset of the record (0 if empty)
+ * Record:	key, NUL, value, NUL
+ *
+ * The hash table uses open addressing with linear probing, exactly like the
+ * index of text map files, and has the same size. The magic begins with a NUL,
+ * so a compiled map can't be mistaken for a text map.
+ */
+
+#define	COMPILED_MAGIC	"\0bonanza-map-1\n"
+#define	MAGIC_SIZE	sizeof(COMPILED_MAGIC)
+#define	HEADER_SIZE	(MAGIC_SIZE + 8)
+#define	SLOT_SIZE	8
 
 
 struct map_entry {
 	const char *key;
 	const char *value;
-	struct map_entry *next;
+	uint32_t hash;		/* of the key, ignoring case */
 };
 
 struct map_file {
 	const char *name;
+	struct stamp stamp;
+	char *arena;		/* all keys and values */
 	struct map_entry *entries;
+	unsigned n_entries;
+	struct map_entry **index; /* open addressing, by hash_str_nocase */
+	unsigned index_size;	/* power of two */
+	const uint8_t *compiled; /* mmap'ed compiled map; NULL if text */
+	size_t compiled_size;
+	unsigned error_line;	/* line of the syntax error; 0 if none */
+	unsigned load_us;	/* time it took to load the file */
 	struct map_file *next;
 };
 
 
 static struct map_file *map_files = NULL;
-static struct map_file *current_map_file = NULL;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct generations generations = GENERATIONS_INIT;
 
 
+/* ----- Helpers ----------------------------------------------------------- */
 
-/* ----- Map file ---------------------------------------------------------- */
 
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
 
-static struct map_file *map_file(const char *name)
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+
+/* ----- Index ------------------------------------------------------------- */
+
+
+/*
+ * The last definition of a key wins. We therefore go through the entries
+ * backwards, and only add the first entry we find for each key.
+ */
+
+static void build_index(struct map_file *m)
+{
+	struct map_entry *e;
+	unsigned mask = 15;
+	unsigned i;
+
+	while (mask < 2 * m->n_entries)
+		mask = mask << 1 | 1;
+	m->index_size = mask + 1;
+	m->index = alloc_type_n(struct map_entry *, m->index_size);
+	memset(m->index, 0, sizeof(struct map_entry *) * m->index_size);
+
+	for (e = m->entries + m->n_entries; e != m->entries;) {
+		e--;
+		for (i = e->hash & mask; m->index[i]; i = (i + 1) & mask)
+			if (m->index[i]->hash == e->hash &&
+			    !strcasecmp(m->index[i]->key, e->key))
+				break;
+		if (!m->index[i])
+			m->index[i] = e;
+	}
+}
+
+
+/* ----- Loading ----------------------------------------------------------- */
+
+
+static void add_mapping(struct map_file *m, unsigned *size, const char *key,
+    const char *value)
+{
+	struct map_entry *e;
+
+	if (m->n_entries == *size) {
+		*size = *size ? *size * 2 : 64;
+		m->entries = realloc_type_n(m->entries, *size);
+	}
+	e = m->entries + m->n_entries++;
+	e->key = key;
+	e->value = value;
+	e->hash = hash_str_nocase(key);
+}
+
+
+/*
+ * Each line contains a key and a value. Empty lines are ignored. If we
+ * encounter a syntax error, we report it, and keep what we have so far.
+ */
+
+static void load_map(struct map_file *m, struct loader *ld)
+{
+	const char *s, *key = NULL, *value = NULL;
+	unsigned size = 0;
+	enum token tok;
+
+	while (1) {
+		tok = map_token(ld, &s);
+		if (tok == tok_string) {
+			if (value)
+				break;
+			if (key)
+				value = s;
+			else
+				key = s;
+			continue;
+		}
+		if (value)
+			add_mapping(m, &size, key, value);
+		else if (key)
+			break;
+		if (tok == tok_eof)
+			return;
+		key = value = NULL;
+	}
+	loader_syntax_error(ld);
+}
+
+
+/*
+ * We only check the header and the size of the hash table here. Records are
+ * checked when we look them up.
+ */
+
+static bool check_compiled(struct map_file *m)
+{
+	const uint8_t *p = m->compiled;
+
+	if (m->compiled_size < HEADER_SIZE ||
+	    m->compiled[m->compiled_size - 1])
+		return 0;
+	m->n_entries = get_le32(p + MAGIC_SIZE);
+	m->index_size = get_le32(p + MAGIC_SIZE + 4);
+	if (!m->index_size || (m->index_size & (m->index_size - 1)))
+		return 0;
+	if (m->n_entries >= m->index_size)
+		return 0;
+	return HEADER_SIZE + (uint64_t) m->index_size * SLOT_SIZE <=
+	    m->compiled_size;
+}
+
+
+/*
+ * Compiled maps stay mapped and are used as they are. Text maps are parsed,
+ * and we then build their index.
+ */
+
+static bool load_map_file(struct map_file *m, const char *name)
+{
+	struct loader ld;
+
+	if (!loader_open(&ld, name))
+		return 0;
+	if (ld.size >= MAGIC_SIZE &&
+	    !memcmp(ld.buf, COMPILED_MAGIC, MAGIC_SIZE)) {
+		m->compiled = (const uint8_t *) ld.buf;
+		m->compiled_size = ld.size;
+		free(loader_keep(&ld));
+		if (check_compiled(m))
+			return 1;
+		errorf("%s: corrupt compiled map", name);
+		(void) munmap((void *) m->compiled, m->compiled_size);
+		m->compiled = NULL;
+		m->n_entries = 0;
+		m->index_size = 0;
+		return 0;
+	}
+	load_map(m, &ld);
+	m->error_line = ld.error_line;
+	m->arena = loader_close(&ld);
+	build_index(m);
+	return 1;
+}
+
+
+static struct map_file *new_map_file(const char *name)
+{
+	struct map_file *m;
+
+	m = alloc_type(struct map_file);
+	m->name = stralloc(name);
+	m->stamp.hash = NULL;
+	m->arena = NULL;
+	m->entries = NULL;
+	m->n_entries = 0;
+	m->index = NULL;
+	m->index_size = 0;
+	m->compiled = NULL;
+	m->compiled_size = 0;
+	m->error_line = 0;
+	m->load_us = 0;
+	m->next = NULL;
+	return m;
+}
+
+
+static void free_map_file(struct map_file *f)
+{
+	free((void *) f->name);
+	stamp_free(&f->stamp);
+	free(f->index);
+	free(f->entries);
+	free(f->arena);
+	if (f->compiled)
+		(void) munmap((void *) f->compiled, f->compiled_size);
+	free(f);
+}
+
+
+/* call with map_lock held */
+
+static struct map_file *find_map_file(const char *name)
 {
 	struct map_file *m;
-	FILE *file;
 
 	for (m = map_files; m; m = m->next)
 		if (!strcmp(m->name, name))
 			return m;
+	return NULL;
+}
 
-	file = fopen(name, "r");
-	if (!file) {
-		errorf("%s: %s", name, strerror(errno));
+
+/*
+ * We don't hold map_lock while loading, so that several files can be loaded
+ * in parallel. If another thread loaded the same file in the meantime, we use
+ * its copy and discard ours.
+ */
+
+static struct map_file *map_file(const char *name)
+{
+	struct timespec t0, t1;
+	struct map_file *m, *old;
+
+	pthread_mutex_lock(&map_lock);
+	m = find_map_file(name);
+	pthread_mutex_unlock(&map_lock);
+	if (m)
+		return m;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	m = new_map_file(name);
+	stamp_init(&m->stamp, name);
+	if (!load_map_file(m, name)) {
+		free_map_file(m);
 		return NULL;
 	}
-
-	m = alloc_type(struct map_file);
-	m->name = stralloc(name);
-	m->entries = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	m->load_us = (t1.tv_sec - t0.tv_sec) * 1000000 +
+	    (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+	pthread_mutex_lock(&map_lock);
+	old = find_map_file(name);
+	if (old) {
+		pthread_mutex_unlock(&map_lock);
+		free_map_file(m);
+		return old;
+	}
 	m->next = map_files;
 	map_files = m;
-
-	current_map_file = m;
-	scan_map(file, name);
-	(void) yyparse();
-	(void) fclose(file);
+	pthread_mutex_unlock(&map_lock);
 
 	return m;
 }
 
 
-void add_mapping(const char *key, const char *value)
-{
-	struct map_entry *e = alloc_type(struct map_entry);
+/*
+ * If the file was already loaded, with a syntax error, we report the error
+ * again.
+ */
 
-	e->key = key;
-	e->value = value;
-	e->next = current_map_file->entries;
-	current_map_file->entries = e;
+bool preload_map_file(const char *name)
+{
+	const struct map_file *m;
+
+	pthread_mutex_lock(&map_lock);
+	m = find_map_file(name);
+	pthread_mutex_unlock(&map_lock);
+	if (m) {
+		if (m->error_line)
+			errorf("%s:%u: syntax error", name, m->error_line);
+	} else {
+		m = map_file(name);
+		if (!m)
+			return 0;
+	}
+	return !m->error_line;
 }
 
 
 /* ----- Lookup ------------------------------------------------------------ */
 
 
-const char *file_map(const char *name, const char *key)
+/*
+ * Return the key of the record at the specified offset, and set *value. Return
+ * NULL if the offset is invalid. Since the file ends with a NUL, all strings
+ * are terminated.
+ */
+
+static const char *compiled_record(const struct map_file *f, uint32_t offset,
+    const char **value)
 {
-	const struct map_file *f;
-	const struct map_entry *e;
+	const char *key = (const char *) f->compiled + offset;
+	size_t key_len;
 
-	f = map_file(name);
-	if (!f)
+	if (offset < HEADER_SIZE + (size_t) f->index_size * SLOT_SIZE ||
+	    offset >= f->compiled_size)
+		return NULL;
+	key_len = strlen(key);
+	if (offset + key_len + 1 >= f->compiled_size)
 		return NULL;
-	for (e = f->entries; e; e = e->next)
-		if (!strcasecmp(e->key, key))
+	*value = key + key_len + 1;
+	return key;
+}
+
+
+static const char *compiled_lookup(const struct map_file *f, const char *key,
+    uint32_t hash)
+{
+	const uint8_t *slots = f->compiled + HEADER_SIZE;
+	const uint8_t *slot;
+	const char *k, *value;
+	unsigned mask = f->index_size - 1;
+	unsigned i, n;
+	uint32_t offset;
+
+	/* the table can't be full, but don't trust the file */
+	for (n = 0, i = hash & mask; n != f->index_size;
+	    n++, i = (i + 1) & mask) {
+		slot = slots + i * SLOT_SIZE;
+		offset = get_le32(slot + 4);
+		if (!offset)
+			break;
+		if (get_le32(slot) != hash)
+			continue;
+		k = compiled_record(f, offset, &value);
+		if (k && !strcasecmp(k, key))
+			return value;
+	}
+	return NULL;
+}
+
+
+const char *map_file_lookup(const struct map_file *f, const char *key)
+{
+	const struct map_entry *e;
+	unsigned mask, i;
+	uint32_t hash;
+
+	hash = hash_str_nocase(key);
+	if (f->compiled)
+		return compiled_lookup(f, key, hash);
+	mask = f->index_size - 1;
+	for (i = hash & mask; (e = f->index[i]); i = (i + 1) & mask)
+		if (e->hash == hash && !strcasecmp(e->key, key))
 			return e->value;
 	return NULL;
 }
 
 
+const char *file_map(const char *name, const char *key)
+{
+	const struct map_file *f;
+
+	f = map_file(name);
+	return f ? map_file_lookup(f, key) : NULL;
+}
+
+
+/* ----- Binding ----------------------------------------------------------- */
+
+
+const struct map_file *map_file_loaded(const char *name)
+{
+	const struct map_file *m;
+
+	pthread_mutex_lock(&map_lock);
+	m = find_map_file(name);
+	pthread_mutex_unlock(&map_lock);
+	return m;
+}
+
+
+const struct generation *map_files_generation(const char *name)
+{
+	return generation_of(&generations, name);
+}
+
+
+/* ----- Compilation ------------------------------------------------------- */
+
+
+/*
+ * The slots of the compiled hash table are those of the index, so only the
+ * last definition of each key is written.
+ */
+
+static bool write_compiled(const struct map_file *m, FILE *file)
+{
+	uint8_t header[HEADER_SIZE];
+	uint8_t slot[SLOT_SIZE];
+	const struct map_entry *e;
+	uint64_t offset;
+	unsigned i, n = 0;
+
+	offset = HEADER_SIZE + (uint64_t) m->index_size * SLOT_SIZE;
+	for (i = 0; i != m->index_size; i++) {
+		e = m->index[i];
+		if (e) {
+			offset += strlen(e->key) + strlen(e->value) + 2;
+			n++;
+		}
+	}
+	if (offset > UINT32_MAX) {
+		errno = EFBIG;
+		return 0;
+	}
+
+	memcpy(header, COMPILED_MAGIC, MAGIC_SIZE);
+	put_le32(header + MAGIC_SIZE, n);
+	put_le32(header + MAGIC_SIZE + 4, m->index_size);
+	if (fwrite(header, 1, HEADER_SIZE, file) != HEADER_SIZE)
+		return 0;
+
+	offset = HEADER_SIZE + (uint64_t) m->index_size * SLOT_SIZE;
+	for (i = 0; i != m->index_size; i++) {
+		e = m->index[i];
+		put_le32(slot, e ? e->hash : 0);
+		put_le32(slot + 4, e ? offset : 0);
+		if (fwrite(slot, 1, SLOT_SIZE, file) != SLOT_SIZE)
+			return 0;
+		if (e)
+			offset += strlen(e->key) + strlen(e->value) + 2;
+	}
+
+	for (i = 0; i != m->index_size; i++) {
+		e = m->index[i];
+		if (!e)
+			continue;
+		if (fwrite(e->key, 1, strlen(e->key) + 1, file) !=
+		    strlen(e->key) + 1)
+			return 0;
+		if (fwrite(e->value, 1, strlen(e->value) + 1, file) !=
+		    strlen(e->value) + 1)
+			return 0;
+	}
+	return 1;
+}
+
+
+bool map_compile(const char *from, const char *to)
+{
+	struct map_file *m;
+	FILE *file;
+	bool ok;
+
+	m = new_map_file(from);
+	if (!load_map_file(m, from)) {
+		free_map_file(m);
+		return 0;
+	}
+	if (m->error_line) {
+		free_map_file(m);
+		return 0;
+	}
+	if (m->compiled) {
+		errorf("%s: already compiled", from);
+		free_map_file(m);
+		return 0;
+	}
+
+	file = fopen(to, "w");
+	if (!file) {
+		errorf("%s: %s", to, strerror(errno));
+		free_map_file(m);
+		return 0;
+	}
+	ok = write_compiled(m, file);
+	if (!ok)
+		errorf("%s: %s", to, strerror(errno));
+	if (fclose(file) == EOF && ok) {
+		errorf("%s: %s", to, strerror(errno));
+		ok = 0;
+	}
+	free_map_file(m);
+	return ok;
+}
+
+
 /* ----- Dumping ----------------------------------------------------------- */
 
 
@@ -120,14 +562,43 @@ static void dump_map_string(const char *s)
 }
 
 
+static void dump_compiled(const struct map_file *f)
+{
+	const char *key, *value;
+	unsigned i;
+	uint32_t offset;
+
+	for (i = 0; i != f->index_size; i++) {
+		offset = get_le32(f->compiled + HEADER_SIZE +
+		    i * SLOT_SIZE + 4);
+		if (!offset)
+			continue;
+		key = compiled_record(f, offset, &value);
+		if (!key)
+			continue;
+		dump_map_string(key);
+		printf("\t");
+		dump_map_string(value);
+		printf("\n");
+	}
+}
+
+
 void dump_map_files(void)
 {
 	const struct map_file *f;
 	const struct map_entry *e;
 
 	for (f = map_files; f; f = f->next) {
-		printf("### %s:\n", f->name);
-		for (e = f->entries; e; e = e->next) {
+		printf("### %s: %s%u entries, %u index slots, "
+		    "loaded in %u.%03u ms\n", f->name,
+		    f->compiled ? "compiled, " : "", f->n_entries,
+		    f->index_size, f->load_us / 1000, f->load_us % 1000);
+		if (f->compiled) {
+			dump_compiled(f);
+			continue;
+		}
+		for (e = f->entries; e != f->entries + f->n_entries; e++) {
 			dump_map_string(e->key);
 			printf("\t");
 			dump_map_string(e->value);
@@ -140,18 +611,28 @@ void dump_map_files(void)
 /* ----- Cleanup ----------------------------------------------------------- */
 
 
-static void free_map_file(struct map_file *f)
+bool expire_map_files(const char *dir)
 {
-	free((void *) f->name);
-	while (f->entries) {
-		struct map_entry *e = f->entries;
-
-		f->entries = e->next;
-		free((void *) e->key);
-		free((void *) e->value);
-		free(e);
+	struct map_file **anchor = &map_files;
+	size_t len = strlen(dir);
+	bool expired = 0;
+
+	pthread_mutex_lock(&map_lock);
+	while (*anchor) {
+		struct map_file *f = *anchor;
+
+		if (!strncmp(f->name, dir, len) && f->name[len] == '/' &&
+		    stamp_changed(&f->stamp, f->name)) {
+			*anchor = f->next;
+			generation_bump(&generations, f->name);
+			free_map_file(f);
+			expired = 1;
+		} else {
+			anchor = &f->next;
+		}
 	}
-	free(f);
+	pthread_mutex_unlock(&map_lock);
+	return expired;
 }
 
 
@@ -163,4 +644,5 @@ void free_map_files(void)
 		map_files = f->next;
 		free_map_file(f);
 	}
+	generation_bump_all(&generations);
 }
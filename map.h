@@ -1,5 +1,5 @@
 /*
- * map.h - Map file parsing and lookup
+ * map.h - Map file loading and lookup
  *
  * Copyright (C) 2022 Linzhi Ltd.
  *
@@ -13,12 +13,51 @@
 #include <stdbool.h>
 
 
+struct map_file;
+struct generation;
+
+
 const char *file_map(const char *name, const char *key);
 
+/*
+ * Rules can look up a map file once, with map_file_loaded, and then access it
+ * directly with map_file_lookup. map_file_loaded returns NULL if the file
+ * isn't loaded.
+ *
+ * The pointer stays valid as long as the generation of the file's directory,
+ * obtained with map_files_generation, stays the same as when the file was
+ * looked up. The generation changes whenever a map file in the directory is
+ * dropped. See gen.h.
+ */
+
+const struct map_file *map_file_loaded(const char *name);
+const char *map_file_lookup(const struct map_file *f, const char *key);
+const struct generation *map_files_generation(const char *name);
+
 void dump_map_files(void);
 
-void add_mapping(const char *key, const char *value);
+/*
+ * map_compile converts the text map file "from" into a compiled map file "to".
+ * On failure, it reports an error and returns 0.
+ */
+
+bool map_compile(const char *from, const char *to);
+
+/*
+ * preload_map_file loads the map file if it isn't loaded yet. It returns 0 if
+ * the file could not be loaded, or if it contains a syntax error. It can be
+ * called from any thread.
+ */
+
+bool preload_map_file(const char *name);
+
+/*
+ * expire_map_files removes map files in the specified directory whose content
+ * has changed since they were loaded. They are reloaded on their next use.
+ * expire_map_files returns 1 if it removed any files.
+ */
 
+bool expire_map_files(const char *dir);
 void free_map_files(void);
 
 #endif /* !MAP_H */
@@ -0,0 +1,34 @@
+/*
+ * mapc.c - Compile map files
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "map.h"
+
+#include "bonanza.h"
+
+
+unsigned verbose = 0;
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s text-map compiled-map\n", name);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+		usage(*argv);
+	return map_compile(argv[1], argv[2]) ? 0 : 1;
+}
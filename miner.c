@@ -23,6 +23,7 @@
 #include "expr.h"
 #include "var.h"
 #include "exec.h"
+#include "intern.h"
 #include "config.h"
 #include "validate.h"
 #include "api.h"
@@ -127,58 +128,61 @@ bool miner_can_calculate(const struct miner *m)
 static void initialize_vars(struct miner_env *env)
 {
 	char buf[4 * 3 + 3 + 1];
-	const char *dest = NULL;
 	const struct cfgvar *cv;
 	const struct miner *m = env->miner;
 
-	assert(!env->exec.cfg_vars);
-	assert(!env->exec.script_vars);
+	assert(!env->exec.cfg_vars->n);
+	assert(!env->exec.script_vars->n);
 
 	sprintf(buf, "0x%x", m->id);
-	var_set(&env->exec.script_vars, "id", NULL, numeric_value(buf, m->id),
+	var_set(env->exec.script_vars, "id", NULL, numeric_value(buf, m->id),
 	    NULL);
 
 	sprintf(buf, IPv4_QUAD_FMT, IPv4_QUAD(m->mqtt.ipv4));
-	var_set(&env->exec.script_vars, "ip", NULL,
+	var_set(env->exec.script_vars, "ip", NULL,
 	     numeric_value(buf, m->mqtt.ipv4), NULL);
 
-	var_set(&env->exec.script_vars, "name", NULL,
+	var_set(env->exec.script_vars, "name", NULL,
 	    string_value(m->name), NULL);
-	var_set(&env->exec.script_vars, "0/serial", NULL,
+	var_set(env->exec.script_vars, "0/serial", NULL,
 	    string_value(m->serial[0]), NULL);
-	var_set(&env->exec.script_vars, "1/serial", NULL,
+	var_set(env->exec.script_vars, "1/serial", NULL,
 	    string_value(m->serial[1]), NULL);
 
-	for (cv = m->config->vars; cv; cv = cv->next) {
-		if (!strncmp(cv->name, "DEST", 4) && cv->name[4] == '_')
-			var_set(&env->exec.cfg_vars, "DEST",  cv->name + 5,
-			    string_value(cv->value), env->exec.validate);
-		else if (strcmp(cv->name, "DEST"))
-			var_set(&env->exec.cfg_vars, cv->name,  NULL,
-			    string_value(cv->value), env->exec.validate);
-		else
-			dest = cv->value;
-	}
-	if (dest)
-		var_set_keys(env->exec.cfg_vars, "DEST", dest);
+	/*
+	 * Plain configuration variables are read from the miner's
+	 * configuration, and only copied when the rules change them. We copy
+	 * the elements of DEST, since DEST = {} and the order of keys affect
+	 * all of them. They don't need validation, since they're the miner's
+	 * own values.
+	 */
+	env->exec.cfg_vars->base = m->config;
+	for (cv = config_elems(m->config); cv && cv->elem; cv = cv->next)
+		var_set(env->exec.cfg_vars, "DEST",  cv->name + 5,
+		    string_value(cv->value), NULL);
+	cv = config_get(m->config, "DEST");
+	if (cv)
+		var_set_keys(env->exec.cfg_vars, "DEST", cv->value);
 }
 
 
-static bool finalize_vars(struct miner_env *env)
+static bool finalize_vars(struct miner_env *env, bool test)
 {
 	char *dest_keys = var_get_keys(env->exec.cfg_vars, "DEST");
 
 	if (dest_keys) {
-		var_set(&env->exec.cfg_vars, "DEST",  NULL,
+		var_set(env->exec.cfg_vars, "DEST",  NULL,
 		    string_value(dest_keys), NULL);
 		free(dest_keys);
 	}
+	if (test)
+		return sw_check(env->exec.script_vars);
 	return sw_miner_setup(env->miner, env->exec.script_vars);
 }
 
 
 bool miner_calculate(struct miner_env *env, struct miner *m,
-    const char *dir, const struct rule *rules)
+    const char *dir, const struct rule *rules, bool test)
 {
 	exec_env_init(&env->exec, dir, m->validate);
 	env->miner = m;
@@ -211,7 +215,7 @@ bool miner_calculate(struct miner_env *env, struct miner *m,
 		printf("-----\n");
 	}
 
-	if (!finalize_vars(env)) {
+	if (!finalize_vars(env, test)) {
 		report = report_fatal;
 		env->error = stralloc(get_error());
 		clear_error();
@@ -219,7 +223,8 @@ bool miner_calculate(struct miner_env *env, struct miner *m,
 	}
 	report = report_fatal;
 
-	env->delta = config_delta(env->miner->config, env->exec.cfg_vars);
+	env->delta = config_delta(env->miner->config,
+	    vars_sorted(env->exec.cfg_vars));
 
 	if (env->flags & mf_delta)
 		dump_delta(env->delta);
@@ -243,19 +248,28 @@ void miner_calculation_finish(struct miner_env *env, char **error,
 }
 
 
+void miner_set_delta(struct miner *m, struct delta *delta)
+{
+	config_free_delta(m->delta);
+	free(m->delta_hash);
+	m->delta = delta;
+	m->delta_hash = delta ? config_hash_delta(delta) : NULL;
+}
+
+
 static void consider_calculation(struct miner *m)
 {
 	struct miner_env env;
+	struct delta *delta;
 
 	if (!miner_can_calculate(m))
 		return;
 
-	miner_calculate(&env, m, ACTIVE_DIR, active_rules);
+	miner_calculate(&env, m, ACTIVE_DIR, active_rules, 0);
 
 	free(m->error);
-	config_free_delta(m->delta);
-
-	miner_calculation_finish(&env, &m->error, &m->delta);
+	miner_calculation_finish(&env, &m->error, &delta);
+	miner_set_delta(m, delta);
 
 	if (env.flags & mf_stop) {
 		stop = 1;
@@ -322,9 +336,16 @@ void miner_set_serial(struct miner *m, const char *serial0, const char *serial1)
 
 static struct validate *process_validate(const char *s)
 {
-	struct validate *val = validate_new();
-	char *tmp = stralloc(s);
-	const char *p = tmp;
+	struct validate *val;
+	char *tmp;
+	const char *p;
+
+	val = validate_lookup(s);
+	if (val)
+		return val;
+	val = validate_new();
+	tmp = stralloc(s);
+	p = tmp;
 
 	while (1) {
 		char *q, *eq;
@@ -343,25 +364,72 @@ static struct validate *process_validate(const char *s)
 		p = q + 1;
 	}
 	free(tmp);
+	validate_share(val, s);
 	return val;
 }
 
 
+static bool has_string(struct json_object *obj, const char *key)
+{
+	struct json_object *val;
+
+	return json_object_object_get_ex(obj, key, &val) &&
+	    json_object_is_type(val, json_type_string);
+}
+
+
+/*
+ * The miner sends its whole configuration. We apply it as changes to the
+ * configuration we have, so that it's only copied (if shared) or hashed again
+ * when something actually changes.
+ */
+
+static void remove_missing(struct miner *m, struct json_object *obj)
+{
+	const struct cfgvar *cv;
+	const char **names;
+	unsigned n = 0, i;
+
+	for (cv = m->config->vars; cv; cv = cv->next)
+		if (!has_string(obj, cv->name))
+			n++;
+	if (!n)
+		return;
+	names = alloc_type_n(const char *, n);
+	i = 0;
+	for (cv = m->config->vars; cv; cv = cv->next)
+		if (!has_string(obj, cv->name))
+			names[i++] = intern_ref(cv->name);
+	for (i = 0; i != n; i++) {
+		config_set(&m->config, names[i], "");
+		intern_put(names[i]);
+	}
+	free(names);
+}
+
+
 static void process_config(struct miner *m, const char *s)
 {
 	struct json_object *obj;
 	json_object_iter iter;
 	enum json_tokener_error err;
 
-	config_free(m->config);
-	m->config = NULL;
+	/* the delta refers to the configuration */
+	miner_set_delta(m, NULL);
+	free(m->config_hash);
+	m->config_hash = NULL;
 
 	obj = json_tokener_parse_verbose(s, &err);
 	if (!obj) {
 		fprintf(stderr, "JSON \"%s\": %s\n",
 		    s, json_tokener_error_desc(err));
+		config_free(m->config);
+		m->config = NULL;
 		return;
 	}
+	if (!m->config)
+		m->config = config_new();
+	remove_missing(m, obj);
 	json_object_object_foreachC(obj, iter) {
 		if (!json_object_is_type(iter.val, json_type_string)) {
 			fprintf(stderr,
@@ -369,15 +437,19 @@ static void process_config(struct miner *m, const char *s)
 			    iter.key);
 			continue;
 		}
-		if (!m->config)
-			m->config = config_new();
-		config_set(m->config, iter.key,
+		config_set(&m->config, iter.key,
 		    json_object_get_string(iter.val));
 	}
 	json_object_put(obj);
 
-	if (m->config)
-		consider_calculation(m);
+	if (!m->config->vars) {
+		config_free(m->config);
+		m->config = NULL;
+		return;
+	}
+	m->config = config_share(m->config);
+	m->config_hash = config_hash(m->config);
+	consider_calculation(m);
 }
 
 
@@ -391,12 +463,13 @@ void miner_deliver(void *user, const char *topic, const char *payload)
 		return;
 	}
 	if (!strcmp(topic, "/config/accept")) {
-		bool new = !m->validate;
+		struct validate *old = m->validate;
 
-		if (!new)
-			validate_free(m->validate);
+		/* get the new table first, in case it's the same */
 		m->validate = process_validate(payload);
-		if (new)
+		if (old)
+			validate_free(old);
+		else
 			consider_calculation(m);
 		return;
 	}
@@ -414,9 +487,13 @@ void miner_deliver(void *user, const char *topic, const char *payload)
 void miner_reset(struct miner *m)
 {
 	m->state = ms_connecting;
-	config_reset(m->config);
-	config_free_delta(m->delta);
-	m->delta = NULL;
+	miner_set_delta(m, NULL);
+	if (m->config) {
+		config_free(m->config);
+		m->config = config_new();
+		free(m->config_hash);
+		m->config_hash = config_hash(m->config);
+	}
 	if (m->validate) {
 		validate_free(m->validate);
 		m->validate = NULL;
@@ -440,6 +517,7 @@ void miner_destroy(struct miner *m)
 		fd_del(m->mqtt.fd);
 	miner_reset(m);
 	config_free(m->config);
+	free(m->config_hash);
 	free(m->restart);
 	free(m);
 }
@@ -475,9 +553,11 @@ struct miner *miner_new(uint32_t id)
 	m->mqtt.fd = NULL;
 	m->validate = NULL;
 	m->config = NULL;
+	m->config_hash = NULL;
 	m->restart = NULL;
 
 	m->delta = NULL;
+	m->delta_hash = NULL;
 	m->error = NULL;
 	m->sw = NULL;
 	sw_miner_reset(m);
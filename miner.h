@@ -44,10 +44,12 @@ struct miner {
 	/* miner data from MQTT */
 	struct validate		*validate;
 	struct config		*config;
+	char			*config_hash;	/* NULL if no config */
 	char			*restart;	/* restart-pending */
 
 	/* script result */
 	struct delta		*delta;
+	char			*delta_hash;	/* NULL if no delta */
 	char			*error;
 
 	struct sw_miner		*sw;		/* ops switch */
@@ -79,11 +81,23 @@ extern struct miner *miners;
 
 
 bool miner_can_calculate(const struct miner *m);
+
+/*
+ * If "test" is set, the calculation does not change the miner's state (i.e.,
+ * the ops switch), and only its result is returned. miner_calculate only
+ * reads the miner's data, so it can also be run on a copy of the miner.
+ */
 bool miner_calculate(struct miner_env *env, struct miner *m,
-    const char *dir, const struct rule *rules);
+    const char *dir, const struct rule *rules, bool test);
 void miner_calculation_finish(struct miner_env *env, char **error,
     struct delta **delta);
 
+/*
+ * miner_set_delta replaces the miner's delta, and updates its hash. Use it
+ * whenever "delta" changes.
+ */
+void miner_set_delta(struct miner *m, struct delta *delta);
+
 const char *consider_updating(struct miner *m, bool request, bool restart);
 
 struct miner *miner_by_id(uint32_t id);
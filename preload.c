@@ -0,0 +1,254 @@
+/*
+ * preload.c - Load map and host files before the rules that use them
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * Map and host files are loaded on first use, which would be in the middle of
+ * running the rules for a miner, on the main loop. Instead, we look for all the
+ * files the rules refer to, and load them on worker threads, before the rules
+ * are put to use.
+ *
+ * We also bind the file references in the rules directly to the loaded files,
+ * so that evaluating them doesn't have to construct the path name and search
+ * for the file. If files in the directory are dropped later (see
+ * expire_map_files), the bindings become stale, and evaluation falls back to
+ * looking up the file by its name until the rules are bound again.
+ */
+
+#define _GNU_SOURCE	/* for asprintf */
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "alloc.h"
+#include "error.h"
+#include "expr.h"
+#include "exec.h"
+#include "host.h"
+#include "map.h"
+#include "preload.h"
+
+
+#define	MAX_THREADS	16
+
+
+struct preload_item {
+	char *name;		/* with directory */
+	bool hosts;		/* host file; else map file */
+	char *error;		/* NULL if loaded successfully */
+	struct preload_item *next;
+};
+
+struct preload_ctx {
+	const char *dir;
+	bool bind;			/* bind instead of collecting names */
+	struct preload_item *items;
+	struct preload_item *next_item;	/* next item to load */
+	pthread_mutex_t lock;		/* protects next_item */
+};
+
+
+/* ----- Collect file names ------------------------------------------------ */
+
+
+static char *path(const struct preload_ctx *ctx, const char *name)
+{
+	char *s;
+
+	if (!ctx->dir)
+		return stralloc(name);
+	if (asprintf(&s, "%s/%s", ctx->dir, name) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	return s;
+}
+
+
+static void add_item(struct preload_ctx *ctx, const char *name, bool hosts)
+{
+	struct preload_item **anchor, *item;
+	char *s = path(ctx, name);
+
+	for (anchor = &ctx->items; *anchor; anchor = &(*anchor)->next)
+		if ((*anchor)->hosts == hosts && !strcmp((*anchor)->name, s)) {
+			free(s);
+			return;
+		}
+	item = alloc_type(struct preload_item);
+	item->name = s;
+	item->hosts = hosts;
+	item->error = NULL;
+	item->next = NULL;
+	*anchor = item;
+}
+
+
+static void bind_map(const struct preload_ctx *ctx, struct expr *e)
+{
+	char *s = path(ctx, e->a.s);
+
+	e->dir_gen = map_files_generation(s);
+	e->gen = generation_value(e->dir_gen);
+	e->map = map_file_loaded(s);
+	free(s);
+}
+
+
+static void bind_hosts(const struct preload_ctx *ctx, struct bool_expr *e)
+{
+	char *s = path(ctx, e->b.s);
+
+	e->dir_gen = host_files_generation(s);
+	e->gen = generation_value(e->dir_gen);
+	e->hosts = host_file_loaded(s);
+	free(s);
+}
+
+
+static void visit_expr(struct expr *e, void *user)
+{
+	struct preload_ctx *ctx = user;
+
+	if (e->op != op_map)
+		return;
+	if (ctx->bind)
+		bind_map(ctx, e);
+	else
+		add_item(ctx, e->a.s, 0);
+}
+
+
+static void visit_bool_expr(struct bool_expr *e, void *user)
+{
+	struct preload_ctx *ctx = user;
+
+	if (e->op != op_in_file)
+		return;
+	if (ctx->bind)
+		bind_hosts(ctx, e);
+	else
+		add_item(ctx, e->b.s, 1);
+}
+
+
+static const struct expr_visitor visitor = { visit_expr, visit_bool_expr };
+
+
+/* ----- Workers ----------------------------------------------------------- */
+
+
+static void *worker(void *user)
+{
+	struct preload_ctx *ctx = user;
+	struct preload_item *item;
+	bool ok;
+
+	report = report_store;
+	while (1) {
+		pthread_mutex_lock(&ctx->lock);
+		item = ctx->next_item;
+		if (item)
+			ctx->next_item = item->next;
+		pthread_mutex_unlock(&ctx->lock);
+		if (!item)
+			break;
+
+		ok = item->hosts ? preload_host_file(item->name) :
+		    preload_map_file(item->name);
+		if (!ok && get_error())
+			item->error = stralloc(get_error());
+		else if (!ok)
+			item->error = stralloc(item->name);
+		clear_error();
+	}
+	return NULL;
+}
+
+
+static void run_workers(struct preload_ctx *ctx, unsigned n)
+{
+	pthread_t threads[MAX_THREADS];
+	long cpus;
+	unsigned n_threads, i;
+	int err;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > MAX_THREADS)
+		cpus = MAX_THREADS;
+	if (cpus > n)
+		cpus = n;
+	for (n_threads = 0; n_threads != cpus; n_threads++) {
+		err = pthread_create(threads + n_threads, NULL, worker, ctx);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i != n_threads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+
+/* ----- Preload and bind -------------------------------------------------- */
+
+
+void bind_files(struct rule *rules, const char *dir)
+{
+	struct preload_ctx ctx;
+
+	ctx.dir = dir;
+	ctx.bind = 1;
+	walk_rules(rules, &visitor, &ctx);
+}
+
+
+char *preload_files(struct rule *rules, const char *dir)
+{
+	struct preload_ctx ctx;
+	struct preload_item *item, *next;
+	char *errors = NULL;
+	unsigned n = 0;
+
+	ctx.dir = dir;
+	ctx.bind = 0;
+	ctx.items = NULL;
+	walk_rules(rules, &visitor, &ctx);
+
+	for (item = ctx.items; item; item = item->next)
+		n++;
+	ctx.next_item = ctx.items;
+	pthread_mutex_init(&ctx.lock, NULL);
+	run_workers(&ctx, n);
+	pthread_mutex_destroy(&ctx.lock);
+	bind_files(rules, dir);
+
+	for (item = ctx.items; item; item = next) {
+		next = item->next;
+		if (item->error) {
+			char *tmp = errors;
+
+			if (asprintf(&errors, "%s%s%s", tmp ? tmp : "",
+			    tmp ? "\n" : "", item->error) < 0) {
+				perror("asprintf");
+				exit(1);
+			}
+			free(tmp);
+		}
+		free(item->name);
+		free(item->error);
+		free(item);
+	}
+	return errors;
+}
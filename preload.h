@@ -0,0 +1,33 @@
+/*
+ * preload.h - Load map and host files before the rules that use them
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef PRELOAD_H
+#define	PRELOAD_H
+
+#include <stdbool.h>
+
+#include "exec.h"
+
+
+/*
+ * preload_files loads all map and host files the rules refer to, in parallel.
+ * File names are relative to "dir", unless "dir" is NULL. If any file can't
+ * be loaded, or has a syntax error, preload_files returns the errors (one per
+ * line), else NULL. The rules can still be used; files that couldn't be
+ * loaded are tried again when the rules use them.
+ *
+ * preload_files also binds the rules to the files. bind_files only binds the
+ * rules to files that are already loaded. The rules must not be in use by
+ * other threads while they're being bound.
+ */
+
+char *preload_files(struct rule *rules, const char *dir);
+void bind_files(struct rule *rules, const char *dir);
+
+#endif /* !PRELOAD_H */
@@ -0,0 +1,91 @@
+/*
+ * stamp.c - File change detection
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "hash.h"
+#include "stamp.h"
+
+
+#define	BUF_SIZE	65536
+
+
+static char *hash_file(const char *name)
+{
+	char buf[BUF_SIZE];
+	struct hash_ctx ctx;
+	struct fingerprint h;
+	FILE *file;
+	size_t got;
+
+	file = fopen(name, "r");
+	if (!file)
+		return NULL;
+	hash_init(&ctx);
+	while ((got = fread(buf, 1, sizeof(buf), file)))
+		hash_update(&ctx, buf, got);
+	if (ferror(file)) {
+		(void) fclose(file);
+		return NULL;
+	}
+	(void) fclose(file);
+	hash_final(&ctx, &h);
+	return fingerprint_string(&h);
+}
+
+
+bool stamp_init(struct stamp *st, const char *name)
+{
+	struct stat s;
+
+	st->hash = NULL;
+	if (stat(name, &s) < 0)
+		return 0;
+	st->mtime = s.st_mtim;
+	st->size = s.st_size;
+	st->hash = hash_file(name);
+	return st->hash;
+}
+
+
+bool stamp_changed(struct stamp *st, const char *name)
+{
+	struct stat s;
+	char *hash;
+	bool same;
+
+	if (stat(name, &s) < 0)
+		return 1;
+	if (st->hash && s.st_size == st->size &&
+	    s.st_mtim.tv_sec == st->mtime.tv_sec &&
+	    s.st_mtim.tv_nsec == st->mtime.tv_nsec)
+		return 0;
+
+	hash = hash_file(name);
+	if (!hash)
+		return 1;
+	same = st->hash && !strcmp(st->hash, hash);
+	free(st->hash);
+	st->hash = hash;
+	st->mtime = s.st_mtim;
+	st->size = s.st_size;
+	return !same;
+}
+
+
+void stamp_free(struct stamp *st)
+{
+	free(st->hash);
+	st->hash = NULL;
+}
@@ -0,0 +1,36 @@
+/*
+ * stamp.h - File change detection
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef STAMP_H
+#define	STAMP_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+
+struct stamp {
+	struct timespec	mtime;
+	off_t		size;
+	char		*hash;	/* content hash */
+};
+
+
+/*
+ * stamp_init records modification time, size, and content hash of a file.
+ * stamp_changed returns 1 if the file's content differs from that recorded in
+ * the stamp (or if the file can't be accessed anymore), and updates the stamp.
+ * The content is only hashed if the modification time or size have changed.
+ */
+
+bool stamp_init(struct stamp *st, const char *name);
+bool stamp_changed(struct stamp *st, const char *name);
+void stamp_free(struct stamp *st);
+
+#endif /* !STAMP_H */
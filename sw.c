@@ -139,7 +139,7 @@ static bool uint32_value(const struct var *var, uint32_t *res)
 }
 
 
-static bool opt_uint32_var(const struct var *vars, const char *name,
+static bool opt_uint32_var(const struct vars *vars, const char *name,
     uint32_t *res, uint32_t deflt)
 {
 	const struct var *var = var_get_var(vars, name, NULL);
@@ -152,19 +152,42 @@ static bool opt_uint32_var(const struct var *vars, const char *name,
 }
 
 
-bool sw_miner_setup(struct miner *m, const struct var *vars)
+bool sw_check(const struct vars *vars)
 {
-	const struct var *var;
+	struct var *const *sw;
+	uint32_t tmp;
+	unsigned n, i;
+
+	sw = var_assoc(vars, "switch", &n);
+	for (i = 0; i != n; i++)
+		if (!uint32_value(sw[i], &tmp))
+			return 0;
+	return opt_uint32_var(vars, "switch_refresh", &tmp,
+	    DEFAULT_SW_REFRESH_S);
+}
+
+
+/*
+ * Switches with overlapping masks set and clear the same bits, so we add them
+ * in a fixed order (by name), independent of the order of assignment.
+ */
+
+bool sw_miner_setup(struct miner *m, const struct vars *vars)
+{
+	struct var **sw;
 	uint32_t mask, tmp;
+	unsigned n, i;
 
 	sw_miner_reset(m);
-	for (var = vars; var; var = var->next)
-		if (!strncmp(var->name, "switch", 6) && var->name[6] == '_' &&
-		    var->assoc) {
-			if (!uint32_value(var, &mask))
-				return 0;
-			sw_miner_add(m, var->name + 7, mask);
+	sw = var_assoc_sorted(vars, "switch", &n);
+	for (i = 0; i != n; i++) {
+		if (!uint32_value(sw[i], &mask)) {
+			free(sw);
+			return 0;
 		}
+		sw_miner_add(m, sw[i]->name + 7, mask);
+	}
+	free(sw);
 	if (!opt_uint32_var(vars, "switch_refresh", &tmp, DEFAULT_SW_REFRESH_S))
 		return 0;
 	m->sw_refresh_s = tmp;
@@ -26,7 +26,8 @@ void sw_subscribe(void);
 void sw_cleanup(void);
 
 void sw_miner_reset(struct miner *m);
-bool sw_miner_setup(struct miner *m, const struct var *vars);
+bool sw_check(const struct vars *vars);	/* like sw_miner_setup, no changes */
+bool sw_miner_setup(struct miner *m, const struct vars *vars);
 
 /* from MQTT */
 void sw_set(const char *topic, bool on);
@@ -0,0 +1,416 @@
+/*
+ * testall.c - Fleet-wide test run in the background
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * The test rules are run for all miners on worker threads. Each worker
+ * operates on a copy of the miner's data, taken when the test run starts, so
+ * that the main loop can continue to update the miners while the test run is
+ * in progress.
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <json-c/json.h>
+
+#include "bonanza.h"
+#include "alloc.h"
+#include "error.h"
+#include "host.h"
+#include "map.h"
+#include "preload.h"
+#include "validate.h"
+#include "config.h"
+#include "exec.h"
+#include "miner.h"
+#include "testall.h"
+
+
+#define	MAX_THREADS	16
+
+
+struct test_item {
+	struct miner	miner;		/* copy of the miner's data */
+	char		*active_hash;	/* delta hash with the active rules */
+	char		*active_error;
+	char		*hash;		/* delta hash with the test rules */
+	char		*error;
+	bool		changed;	/* test result differs from active */
+};
+
+struct result_key {
+	bool		error;
+	const char	*s;
+};
+
+
+static struct rule *rules = NULL;	/* copy of the test rules */
+static struct test_item *items = NULL;
+static unsigned n_items = 0;
+static unsigned next_item;		/* next item to process (atomic) */
+static unsigned done = 0;		/* items processed (atomic) */
+static bool cancel;			/* stop workers (atomic) */
+static pthread_t threads[MAX_THREADS];
+static unsigned n_threads = 0;		/* 0 if workers are finished */
+
+
+/* ----- Workers ----------------------------------------------------------- */
+
+
+static void *worker(void *user)
+{
+	while (!__atomic_load_n(&cancel, __ATOMIC_RELAXED)) {
+		unsigned i = __atomic_fetch_add(&next_item, 1,
+		    __ATOMIC_RELAXED);
+		struct test_item *item;
+		struct miner_env env;
+		struct delta *delta;
+
+		if (i >= n_items)
+			break;
+		item = items + i;
+		miner_calculate(&env, &item->miner, TEST_DIR, rules, 1);
+		miner_calculation_finish(&env, &item->error, &delta);
+		if (!item->error)
+			item->hash = config_hash_delta(delta);
+		config_free_delta(delta);
+		__atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+
+static void reap(bool stop_now)
+{
+	unsigned i;
+
+	if (!n_threads)
+		return;
+	if (stop_now)
+		__atomic_store_n(&cancel, 1, __ATOMIC_RELAXED);
+	else if (__atomic_load_n(&done, __ATOMIC_ACQUIRE) != n_items)
+		return;
+	for (i = 0; i != n_threads; i++)
+		pthread_join(threads[i], NULL);
+	n_threads = 0;
+}
+
+
+bool test_all_running(void)
+{
+	reap(0);
+	return n_threads;
+}
+
+
+/* ----- Miner copies ------------------------------------------------------ */
+
+
+static void copy_miner(struct miner *copy, const struct miner *m)
+{
+	memset(copy, 0, sizeof(*copy));
+	copy->id = m->id;
+	copy->name = stralloc(m->name);
+	copy->serial[0] = stralloc(m->serial[0]);
+	copy->serial[1] = stralloc(m->serial[1]);
+	copy->state = ms_shutdown;
+	copy->mqtt.ipv4 = m->mqtt.ipv4;
+	copy->validate = validate_get(m->validate);
+	copy->config = config_ref(m->config);
+}
+
+
+static void free_items(void)
+{
+	struct test_item *item;
+
+	for (item = items; item != items + n_items; item++) {
+		free(item->miner.name);
+		free(item->miner.serial[0]);
+		free(item->miner.serial[1]);
+		validate_free(item->miner.validate);
+		config_free(item->miner.config);
+		free(item->active_hash);
+		free(item->active_error);
+		free(item->hash);
+		free(item->error);
+	}
+	free(items);
+	items = NULL;
+	n_items = 0;
+	free_rules(rules);
+	rules = NULL;
+}
+
+
+/* ----- Start a test run -------------------------------------------------- */
+
+
+char *test_all_start(void)
+{
+	struct test_item *item;
+	struct rule *new;
+	const struct miner *m;
+	long cpus;
+	unsigned n = 0;
+	char *error, *unloaded;
+	int err;
+
+	if (test_all_running())
+		return stralloc("test run in progress");
+
+	expire_host_files(TEST_DIR);
+	expire_map_files(TEST_DIR);
+
+	report = report_store;
+	new = rules_file(TEST_DIR "/" SCRIPT_NAME);
+	report = report_fatal;
+	if (get_error()) {
+		error = stralloc(get_error());
+		clear_error();
+		free_rules(new);
+		return error;
+	}
+
+	/* files that can't be loaded only affect miners whose rules use them */
+	unloaded = preload_files(new, TEST_DIR);
+	free_items();
+	rules = new;
+	/* only for the speed-up; the test report shows errors per miner */
+	free(prevalidate(rules));
+
+	for (m = miners; m; m = m->next)
+		if (miner_can_calculate(m))
+			n++;
+	items = alloc_type_n(struct test_item, n ? n : 1);
+	item = items;
+	for (m = miners; m; m = m->next) {
+		if (!miner_can_calculate(m))
+			continue;
+		copy_miner(&item->miner, m);
+		item->active_hash = m->delta ? stralloc(m->delta_hash) : NULL;
+		item->active_error = m->error ? stralloc(m->error) : NULL;
+		item->hash = NULL;
+		item->error = NULL;
+		item++;
+	}
+	n_items = n;
+	next_item = 0;
+	done = 0;
+	cancel = 0;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > MAX_THREADS)
+		cpus = MAX_THREADS;
+	if (cpus > n)
+		cpus = n;
+	for (n_threads = 0; n_threads != cpus; n_threads++) {
+		err = pthread_create(threads + n_threads, NULL, worker, NULL);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	if (!unloaded)
+		return stralloc("");
+	asprintf_req(&error,
+	    "Test run started, but some files could not be loaded:\n%s",
+	    unloaded);
+	free(unloaded);
+	return error;
+}
+
+
+/* ----- Summary ----------------------------------------------------------- */
+
+
+static int comp_key(const void *a, const void *b)
+{
+	const struct result_key *ka = a;
+	const struct result_key *kb = b;
+
+	if (ka->error != kb->error)
+		return ka->error ? 1 : -1;
+	if (!ka->s || !kb->s)
+		return !ka->s - !kb->s;
+	return strcmp(ka->s, kb->s);
+}
+
+
+static int comp_item(const void *a, const void *b)
+{
+	const struct test_item *const *ia = a;
+	const struct test_item *const *ib = b;
+	struct result_key ka = { (*ia)->error, (*ia)->error ? (*ia)->error :
+	    (*ia)->hash };
+	struct result_key kb = { (*ib)->error, (*ib)->error ? (*ib)->error :
+	    (*ib)->hash };
+
+	return comp_key(&ka, &kb);
+}
+
+
+static bool same_result(const struct test_item *item)
+{
+	if (item->error || item->active_error)
+		return item->error && item->active_error &&
+		    !strcmp(item->error, item->active_error);
+	return item->hash && item->active_hash &&
+	    !strcmp(item->hash, item->active_hash);
+}
+
+
+static void add(json_object *obj, const char *name, json_object *value)
+{
+	if (json_object_object_add(obj, name, value) < 0) {
+		perror("json_object_object_add");
+		exit(1);
+	}
+}
+
+
+static json_object *new_int(int n)
+{
+	json_object *obj = json_object_new_int(n);
+
+	if (!obj) {
+		perror("json_object_new_int");
+		exit(1);
+	}
+	return obj;
+}
+
+
+static json_object *new_string_or_null(const char *s)
+{
+	json_object *obj;
+
+	if (!s)
+		return NULL;
+	obj = json_object_new_string(s);
+	if (!obj) {
+		perror("json_object_new_string");
+		exit(1);
+	}
+	return obj;
+}
+
+
+static void summary(json_object *obj)
+{
+	struct test_item **sorted;
+	struct result_key *active;
+	json_object *groups;
+	unsigned changed = 0, new_errors = 0, new_groups = 0;
+	unsigned i, j;
+
+	sorted = alloc_type_n(struct test_item *, n_items ? n_items : 1);
+	active = alloc_type_n(struct result_key, n_items ? n_items : 1);
+	for (i = 0; i != n_items; i++) {
+		struct test_item *item = items + i;
+
+		item->changed = !same_result(item);
+		changed += item->changed;
+		new_errors += item->error && !item->active_error;
+		sorted[i] = item;
+		active[i].error = item->active_error;
+		active[i].s = item->active_error ? item->active_error :
+		    item->active_hash;
+	}
+	qsort(sorted, n_items, sizeof(*sorted), comp_item);
+	qsort(active, n_items, sizeof(*active), comp_key);
+
+	groups = json_object_new_array();
+	if (!groups) {
+		perror("json_object_new_array");
+		exit(1);
+	}
+	for (i = 0; i != n_items; i = j) {
+		const struct test_item *first = sorted[i];
+		struct result_key key = { first->error,
+		    first->error ? first->error : first->hash };
+		json_object *group;
+		unsigned group_changed = 0;
+		bool new;
+
+		for (j = i; j != n_items && !comp_item(sorted + i, sorted + j);
+		    j++)
+			group_changed += sorted[j]->changed;
+		new = !bsearch(&key, active, n_items, sizeof(*active),
+		    comp_key);
+		new_groups += new;
+
+		group = json_object_new_object();
+		if (!group) {
+			perror("json_object_new_object");
+			exit(1);
+		}
+		add(group, "delta_hash", new_string_or_null(first->hash));
+		add(group, "error", new_string_or_null(first->error));
+		add(group, "miners", new_int(j - i));
+		add(group, "changed", new_int(group_changed));
+		add(group, "new", json_object_new_boolean(new));
+		if (json_object_array_add(groups, group) < 0) {
+			perror("json_object_array_add");
+			exit(1);
+		}
+	}
+	free(sorted);
+	free(active);
+
+	add(obj, "changed", new_int(changed));
+	add(obj, "new_errors", new_int(new_errors));
+	add(obj, "new_groups", new_int(new_groups));
+	add(obj, "groups", groups);
+}
+
+
+char *test_all_json(void)
+{
+	json_object *obj;
+	const char *tmp;
+	bool running = test_all_running();
+	char *s;
+
+	obj = json_object_new_object();
+	if (!obj) {
+		perror("json_object_new_object");
+		exit(1);
+	}
+	add(obj, "running", json_object_new_boolean(running));
+	add(obj, "done", new_int(__atomic_load_n(&done, __ATOMIC_ACQUIRE)));
+	add(obj, "total", new_int(n_items));
+	if (!running)
+		summary(obj);
+	tmp = json_object_to_json_string(obj);
+	if (!tmp) {
+		perror("json_object_to_json_string");
+		exit(1);
+	}
+	s = stralloc(tmp);
+	json_object_put(obj);
+	return s;
+}
+
+
+/* ----- Cleanup ----------------------------------------------------------- */
+
+
+void test_all_cleanup(void)
+{
+	reap(1);
+	free_items();
+}
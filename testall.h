@@ -0,0 +1,23 @@
+/*
+ * testall.h - Fleet-wide test run in the background
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef TESTALL_H
+#define	TESTALL_H
+
+#include <stdbool.h>
+
+
+bool test_all_running(void);
+
+char *test_all_start(void);
+char *test_all_json(void);
+
+void test_all_cleanup(void);
+
+#endif /* !TESTALL_H */
@@ -1,68 +1,105 @@
 /*
  * validate.c - Validation of variable names and values
  *
- * Copyright (C) 2022 Linzhi Ltd.
+ * Copyright (C) 2022, 2023 Linzhi Ltd.
  *
  * This work is licensed under the terms of the MIT License.
  * A copy of the license can be found in the file COPYING.txt
  */
 
+/*
+ * The miner sends a list of name and value patterns. The first (i.e., most
+ * recently added) entry whose name pattern matches the variable name decides
+ * which values are valid.
+ *
+ * Most name patterns are plain strings. We find them with a hash table, and
+ * only run the regular expressions of the few other patterns. Of these, we
+ * skip those whose literal prefix (e.g., "DEST_" in "DEST_.*") doesn't match.
+ * Value patterns are only compiled when they are first used.
+ *
+ * Many miners have the same variables with the same values, so we also
+ * remember recent results, in a small direct-mapped cache per table.
+ */
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <regex.h>
+#include <pthread.h>
 
 #include "alloc.h"
+#include "hash.h"
 #include "validate.h"
 
 
 #define	ERR_BUF_LEN	200
+#define	INITIAL_BUCKETS	64
+#define	MEMO_SIZE	1024	/* power of two */
+
+#define	REGEX_SPECIAL	".[]()*+?{}|^$\\"
 
 
 struct validate_var {
-	regex_t name;
-	regex_t value;
-	struct validate_var *next;
+	char *name;		/* pattern */
+	char *value;		/* pattern */
+	unsigned seq;		/* order in which entries were added */
+	bool literal;		/* name pattern is a plain string */
+	size_t prefix_len;	/* literal prefix of name pattern */
+	regex_t name_re;	/* if not literal */
+	regex_t value_re;	/* if value_compiled */
+	bool value_compiled;	/* atomic */
+	struct validate_var *next;		/* all entries, newest first */
+	struct validate_var *next_pattern;	/* only if not literal */
+	struct validate_var *chain;		/* literal: next in bucket */
 };
 
-struct validate {
-	struct validate_var *vars;
+struct memo_entry {
+	uint64_t hash;
+	char *name;		/* NULL if unused */
+	char *value;
+	unsigned result;
 };
 
+struct validate_memo {
+	pthread_mutex_t lock;
+	struct memo_entry entries[MEMO_SIZE];
+};
 
-/* ----- File name validity check ------------------------------------------ */
-
+struct validate {
+	struct validate_var *vars;
+	struct validate_var *patterns;	/* name patterns, newest first */
+	struct validate_var **buckets;	/* plain names */
+	unsigned n_buckets;		/* power of two */
+	unsigned n_literal;		/* entries with plain names */
+	unsigned seq;
+	unsigned refs;
+	unsigned id;
+	struct validate_memo *memo;
+
+	/* sharing */
+	char *source;			/* NULL if not shared */
+	struct fingerprint source_hash;
+	struct validate *next_shared;
+};
 
-bool valid_file_name(const char *s)
-{
-	return !strchr(s, '/');
-}
 
+/* serializes compilation of value patterns */
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* ----- Matching ---------------------------------------------------------- */
+static struct validate *shared = NULL;
+static unsigned next_id = 0;
 
 
-static bool match(const regex_t *preg, const char *s)
-{
-	return !regexec(preg, s, 0, NULL, 0);
-}
+/* ----- File name validity check ------------------------------------------ */
 
 
-unsigned validate(const struct validate *val, const char *name,
-    const char *value)
+bool valid_file_name(const char *s)
 {
-	const struct validate_var *vv;
-
-	for (vv = val->vars; vv; vv = vv->next) {
-		if (!*value)
-			return 2;
-		if (match(&vv->name, name))
-			return match(&vv->value, value) ? 2 : 1;
-	}
-	return 0;
+	return !strchr(s, '/');
 }
 
 
-/* ----- Construction ------------------------------------------------------ */
+/* ----- Regular expressions ----------------------------------------------- */
 
 
 static void re(regex_t *preg, const char *s)
@@ -94,37 +131,317 @@ static void re(regex_t *preg, const char *s)
 }
 
 
+/*
+ * Length of the prefix every matching name must begin with. A character
+ * followed by a quantifier may be absent, and alternatives can begin with
+ * anything.
+ */
+
+static size_t literal_prefix(const char *s)
+{
+	size_t len;
+
+	if (strchr(s, '|'))
+		return 0;
+	len = strcspn(s, REGEX_SPECIAL);
+	if (len && s[len] && strchr("*+?{", s[len]))
+		len--;
+	return len;
+}
+
+
+static bool match(const regex_t *preg, const char *s)
+{
+	return !regexec(preg, s, 0, NULL, 0);
+}
+
+
+/* ----- Matching ---------------------------------------------------------- */
+
+
+static struct validate_var **bucket(const struct validate *val, uint32_t hash)
+{
+	return val->buckets + (hash & (val->n_buckets - 1));
+}
+
+
+static struct validate_var *find_literal(const struct validate *val,
+    const char *name)
+{
+	struct validate_var *vv, *found = NULL;
+
+	if (!val->n_literal)
+		return NULL;
+	for (vv = *bucket(val, hash_str_nocase(name)); vv; vv = vv->chain)
+		if (!strcmp(vv->name, name) && (!found || vv->seq > found->seq))
+			found = vv;
+	return found;
+}
+
+
+static bool match_value(struct validate_var *vv, const char *value)
+{
+	if (!__atomic_load_n(&vv->value_compiled, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&compile_lock);
+		if (!vv->value_compiled) {
+			re(&vv->value_re, vv->value);
+			__atomic_store_n(&vv->value_compiled, 1,
+			    __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&compile_lock);
+	}
+	return match(&vv->value_re, value);
+}
+
+
+static unsigned lookup(const struct validate *val, const char *name,
+    const char *value)
+{
+	struct validate_var *vv, *found;
+
+	/* patterns added after the plain name take precedence */
+	found = find_literal(val, name);
+	for (vv = val->patterns; vv; vv = vv->next_pattern) {
+		if (found && vv->seq < found->seq)
+			break;
+		if (strncmp(name, vv->name, vv->prefix_len))
+			continue;
+		if (match(&vv->name_re, name)) {
+			found = vv;
+			break;
+		}
+	}
+	if (!found)
+		return 0;
+	return match_value(found, value) ? 2 : 1;
+}
+
+
+static uint64_t memo_hash(const char *name, const char *value)
+{
+	struct hash_ctx ctx;
+	struct fingerprint h;
+
+	hash_init(&ctx);
+	hash_update(&ctx, name, strlen(name) + 1);
+	hash_update(&ctx, value, strlen(value));
+	hash_final(&ctx, &h);
+	return h.lo;
+}
+
+
+unsigned validate(const struct validate *val, const char *name,
+    const char *value)
+{
+	struct validate_memo *memo = val->memo;
+	uint64_t hash;
+	struct memo_entry *e;
+	unsigned res;
+
+	if (!val->vars)
+		return 0;
+	if (!*value)
+		return 2;
+
+	hash = memo_hash(name, value);
+	e = memo->entries + (hash & (MEMO_SIZE - 1));
+	pthread_mutex_lock(&memo->lock);
+	if (e->name && e->hash == hash && !strcmp(e->name, name) &&
+	    !strcmp(e->value, value)) {
+		res = e->result;
+		pthread_mutex_unlock(&memo->lock);
+		return res;
+	}
+	pthread_mutex_unlock(&memo->lock);
+
+	res = lookup(val, name, value);
+
+	pthread_mutex_lock(&memo->lock);
+	free(e->name);
+	free(e->value);
+	e->hash = hash;
+	e->name = stralloc(name);
+	e->value = stralloc(value);
+	e->result = res;
+	pthread_mutex_unlock(&memo->lock);
+	return res;
+}
+
+
+/* ----- Construction ------------------------------------------------------ */
+
+
+static void add_literal(struct validate *val, struct validate_var *vv)
+{
+	struct validate_var **b;
+
+	b = bucket(val, hash_str_nocase(vv->name));
+	vv->chain = *b;
+	*b = vv;
+}
+
+
+static void grow(struct validate *val)
+{
+	struct validate_var *vv;
+
+	val->n_buckets = val->n_buckets ? val->n_buckets * 2 : INITIAL_BUCKETS;
+	free(val->buckets);
+	val->buckets = alloc_type_n(struct validate_var *, val->n_buckets);
+	memset(val->buckets, 0,
+	    sizeof(struct validate_var *) * val->n_buckets);
+	for (vv = val->vars; vv; vv = vv->next)
+		if (vv->literal)
+			add_literal(val, vv);
+}
+
+
 void validate_add(struct validate *val, const char *name, const char *value)
 {
 	struct validate_var *vv;
 
 	vv = alloc_type(struct validate_var);
-	re(&vv->name, name);
-	re(&vv->value, value);
+	vv->name = stralloc(name);
+	vv->value = stralloc(value);
+	vv->seq = val->seq++;
+	vv->literal = !name[strcspn(name, REGEX_SPECIAL)];
+	vv->value_compiled = 0;
 	vv->next = val->vars;
 	val->vars = vv;
+
+	if (vv->literal) {
+		if (val->n_literal == val->n_buckets)
+			grow(val);
+		else
+			add_literal(val, vv);
+		val->n_literal++;
+	} else {
+		re(&vv->name_re, name);
+		vv->prefix_len = literal_prefix(name);
+		vv->next_pattern = val->patterns;
+		val->patterns = vv;
+	}
 }
 
 
+/* ----- Sharing ----------------------------------------------------------- */
+
+
+static void hash_source(struct fingerprint *h, const char *source)
+{
+	struct hash_ctx ctx;
+
+	hash_init(&ctx);
+	hash_update(&ctx, source, strlen(source));
+	hash_final(&ctx, h);
+}
+
+
+struct validate *validate_lookup(const char *source)
+{
+	struct fingerprint h;
+	struct validate *val;
+
+	hash_source(&h, source);
+	for (val = shared; val; val = val->next_shared)
+		if (val->source_hash.lo == h.lo &&
+		    val->source_hash.hi == h.hi &&
+		    !strcmp(val->source, source))
+			return validate_get(val);
+	return NULL;
+}
+
+
+void validate_share(struct validate *val, const char *source)
+{
+	val->source = stralloc(source);
+	hash_source(&val->source_hash, source);
+	val->next_shared = shared;
+	shared = val;
+}
+
+
+const struct validate *validate_shared(const struct validate *prev)
+{
+	return prev ? prev->next_shared : shared;
+}
+
+
+static void unshare(struct validate *val)
+{
+	struct validate **anchor;
+
+	for (anchor = &shared; *anchor != val;
+	    anchor = &(*anchor)->next_shared)
+		;
+	*anchor = val->next_shared;
+	free(val->source);
+}
+
+
+/* ----- Reference counting ------------------------------------------------ */
+
+
 struct validate *validate_new(void)
 {
 	struct validate *val;
 
 	val = alloc_type(struct validate);
 	val->vars = NULL;
+	val->source = NULL;
+	val->patterns = NULL;
+	val->buckets = NULL;
+	val->n_buckets = 0;
+	val->n_literal = 0;
+	val->seq = 0;
+	val->refs = 1;
+	val->id = next_id++;
+	val->memo = alloc_type(struct validate_memo);
+	pthread_mutex_init(&val->memo->lock, NULL);
+	memset(val->memo->entries, 0, sizeof(val->memo->entries));
+	return val;
+}
+
+
+unsigned validate_id(const struct validate *val)
+{
+	return val->id;
+}
+
+
+struct validate *validate_get(struct validate *val)
+{
+	val->refs++;
 	return val;
 }
 
 
 void validate_free(struct validate *val)
 {
+	unsigned i;
+
+	if (--val->refs)
+		return;
+	if (val->source)
+		unshare(val);
 	while (val->vars) {
 		struct validate_var *vv = val->vars;
 
-		regfree(&vv->name);
-		regfree(&vv->value);
+		if (!vv->literal)
+			regfree(&vv->name_re);
+		if (vv->value_compiled)
+			regfree(&vv->value_re);
+		free(vv->name);
+		free(vv->value);
 		val->vars = vv->next;
 		free(vv);
 	}
+	for (i = 0; i != MEMO_SIZE; i++) {
+		free(val->memo->entries[i].name);
+		free(val->memo->entries[i].value);
+	}
+	pthread_mutex_destroy(&val->memo->lock);
+	free(val->memo);
+	free(val->buckets);
 	free(val);
 }
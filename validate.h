@@ -28,7 +28,34 @@ unsigned validate(const struct validate *val, const char *name,
     const char *value);
 void validate_add(struct validate *val, const char *name, const char *value);
 
+/*
+ * Validation tables are reference-counted. validate_get adds a reference,
+ * validate_free removes one, and frees the table when the last reference is
+ * gone.
+ */
+
 struct validate *validate_new(void);
+struct validate *validate_get(struct validate *val);
 void validate_free(struct validate *val);
 
+/*
+ * Miners with the same firmware send the same list, so we share tables made
+ * from the same source text. validate_lookup returns a new reference to such
+ * a table, NULL if there is none. validate_share makes a table available to
+ * validate_lookup, until its last reference is gone. Sharing is only done on
+ * the main thread.
+ */
+
+struct validate *validate_lookup(const char *source);
+void validate_share(struct validate *val, const char *source);
+
+/*
+ * validate_shared iterates over the shared tables, starting with
+ * validate_shared(NULL). validate_id returns a number that identifies the
+ * table, and is not reused when the table is freed.
+ */
+
+const struct validate *validate_shared(const struct validate *prev);
+unsigned validate_id(const struct validate *val);
+
 #endif /* !VALIDATE_H */
@@ -10,78 +10,269 @@
 #define	_GNU_SOURCE	/* for asprintf */
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 
 #include "alloc.h"
+#include "hash.h"
 #include "error.h"
 #include "expr.h"
 #include "validate.h"
 #include "exec.h"
+#include "config.h"
 #include "var.h"
 
 
-static unsigned sequence = 0;
+#define	INITIAL_BUCKETS	64
 
 
-/* ----- Ordering of associative arrays ------------------------------------ */
+static __thread unsigned sequence = 0;
 
 
-static struct var **assoc_list(struct var *vars, const char *base, unsigned *n)
+/* ----- Hash table -------------------------------------------------------- */
+
+
+/*
+ * Elements of associative arrays are named base_key. We hash and compare the
+ * two parts without joining them first.
+ */
+
+static uint32_t hash_name(const char *name, const char *key)
+{
+	uint32_t h = hash_str(name);
+
+	if (key) {
+		h = fnv_mix(h, '_');
+		h = hash_str_continue(h, key);
+	}
+	return h;
+}
+
+
+static bool same_name(const char *s, const char *name, const char *key)
+{
+	size_t len;
+
+	if (!key)
+		return !strcmp(s, name);
+	len = strlen(name);
+	return !strncmp(s, name, len) && s[len] == '_' &&
+	    !strcmp(s + len + 1, key);
+}
+
+
+static struct var **bucket(const struct vars *vars, uint32_t hash)
+{
+	return vars->buckets + (hash & (vars->n_buckets - 1));
+}
+
+
+static struct var *find(const struct vars *vars, const char *name,
+    const char *key, uint32_t hash)
 {
-	struct var **list = NULL;
-	size_t base_len = strlen(base);
 	struct var *v;
 
-	*n = 0;
-	for (v = vars; v; v = v->next) {
-		if (strncmp(v->name, base, base_len))
-			continue;
-		if (v->name[base_len] != '_')
-			continue;
-		if (!v->assoc)
-			continue;
-		list = realloc_type_n(list, *n + 1);
-		list[*n] = v;
-		(*n)++;
+	for (v = *bucket(vars, hash); v; v = v->chain)
+		if (v->hash == hash && same_name(v->name, name, key))
+			return v;
+	return NULL;
+}
+
+
+static void grow(struct vars *vars)
+{
+	struct var *v;
+	struct var **b;
+
+	vars->n_buckets *= 2;
+	free(vars->buckets);
+	vars->buckets = alloc_type_n(struct var *, vars->n_buckets);
+	memset(vars->buckets, 0, sizeof(struct var *) * vars->n_buckets);
+	for (v = vars->list; v; v = v->next) {
+		b = bucket(vars, v->hash);
+		v->chain = *b;
+		*b = v;
 	}
+}
+
+
+static void link_var(struct vars *vars, struct var *v)
+{
+	struct var **b;
+
+	v->next = vars->list;
+	if (v->next)
+		v->next->prev = &v->next;
+	v->prev = &vars->list;
+	vars->list = v;
+	vars->sorted = vars->sorted &&
+	    (!v->next || strcmp(v->name, v->next->name) < 0);
+
+	b = bucket(vars, v->hash);
+	v->chain = *b;
+	*b = v;
+	vars->n++;
+}
+
+
+static void remove_var(struct vars *vars, struct var *v)
+{
+	struct var **anchor;
+
+	for (anchor = bucket(vars, v->hash); *anchor != v;
+	    anchor = &(*anchor)->chain)
+		;
+	*anchor = v->chain;
+	*v->prev = v->next;
+	if (v->next)
+		v->next->prev = v->prev;
+	vars->n--;
+	free(v->name);
+	free_value(v->value);
+	free(v);
+}
+
+
+struct vars *vars_new(void)
+{
+	struct vars *vars;
+
+	vars = alloc_type(struct vars);
+	vars->n_buckets = INITIAL_BUCKETS;
+	vars->buckets = alloc_type_n(struct var *, vars->n_buckets);
+	memset(vars->buckets, 0, sizeof(struct var *) * vars->n_buckets);
+	vars->n = 0;
+	vars->list = NULL;
+	vars->sorted = 1;
+	vars->assoc = NULL;
+	vars->base = NULL;
+	return vars;
+}
+
+
+/* ----- Sorted list ------------------------------------------------------- */
+
+
+static int cmp_name(const void *a, const void *b)
+{
+	const struct var *const *va = a;
+	const struct var *const *vb = b;
+
+	return strcmp((*va)->name, (*vb)->name);
+}
+
+
+const struct var *vars_sorted(struct vars *vars)
+{
+	struct var **array, **anchor;
+	struct var *v;
+	unsigned i = 0;
+
+	if (vars->sorted)
+		return vars->list;
+	array = alloc_type_n(struct var *, vars->n ? vars->n : 1);
+	for (v = vars->list; v; v = v->next)
+		array[i++] = v;
+	qsort(array, vars->n, sizeof(*array), cmp_name);
+	anchor = &vars->list;
+	for (i = 0; i != vars->n; i++) {
+		*anchor = array[i];
+		array[i]->prev = anchor;
+		anchor = &array[i]->next;
+	}
+	*anchor = NULL;
+	free(array);
+	vars->sorted = 1;
+	return vars->list;
+}
+
+
+/* ----- Associative arrays ----------------------------------------------- */
+
+
+static struct assoc *find_assoc(const struct vars *vars, const char *base)
+{
+	struct assoc *a;
+
+	for (a = vars->assoc; a; a = a->next)
+		if (!strcmp(a->base, base))
+			return a;
+	return NULL;
+}
+
+
+static void add_elem(struct vars *vars, const char *base, struct var *v)
+{
+	struct assoc *a = find_assoc(vars, base);
+
+	if (!a) {
+		a = alloc_type(struct assoc);
+		a->base = stralloc(base);
+		a->elems = NULL;
+		a->n = a->size = 0;
+		a->next = vars->assoc;
+		vars->assoc = a;
+	}
+	if (a->n == a->size) {
+		a->size = a->size ? a->size * 2 : 16;
+		a->elems = realloc_type_n(a->elems, a->size);
+	}
+	a->elems[a->n++] = v;
+}
+
+
+struct var *const *var_assoc(const struct vars *vars, const char *base,
+    unsigned *n)
+{
+	const struct assoc *a = find_assoc(vars, base);
+
+	*n = a ? a->n : 0;
+	return a ? a->elems : NULL;
+}
+
+
+struct var **var_assoc_sorted(const struct vars *vars, const char *base,
+    unsigned *n)
+{
+	struct var *const *elems = var_assoc(vars, base, n);
+	struct var **list;
+
+	list = alloc_type_n(struct var *, *n ? *n : 1);
+	if (*n)
+		memcpy(list, elems, sizeof(struct var *) * *n);
+	qsort(list, *n, sizeof(*list), cmp_name);
 	return list;
 }
 
 
-void var_set_keys(struct var *vars, const char *base, const char *keys)
+void var_set_keys(struct vars *vars, const char *base, const char *keys)
 {
-	unsigned n;
-	struct var **list = assoc_list(vars, base, &n);
-	size_t base_len = strlen(base);
 	const char *p;
 
 	p = keys;
 	while (1) {
-		struct var **v;
+		struct var *v;
 		const char *end;
-		unsigned key_len;
+		char *key;
 
 		end = strchr(p, ' ');
 		if (!end)
 			end = strchr(p, 0);
-		key_len = end - p;
-		for (v = list; v != list + n; v++)
-			if (!strncmp((*v)->name + base_len + 1, p, key_len) &&
-			   !(*v)->name[base_len + 1 + key_len] &&
-			   (*v)->assoc)
-				break;
-		if (v)
-			(*v)->seq = sequence++;
+		key = strnalloc(p, end - p);
+		v = find(vars, base, key, hash_name(base, key));
+		if (v && v->assoc)
+			v->seq = sequence++;
 		else
-			fprintf(stderr, "warning: key \"%.*s\" not found\n",
-			    (int) (end - p), p);
+			fprintf(stderr, "warning: key \"%s\" not found\n",
+			    key);
+		free(key);
 		if (!*end)
 			break;
 		p = end + 1;
 	}
-	free(list);
 }
 
 
@@ -94,16 +285,20 @@ static int cmp_seq(const void *a, const void *b)
 }
 
 
-char *var_get_keys(struct var *vars, const char *base)
+char *var_get_keys(struct vars *vars, const char *base)
 {
-	unsigned n;
-	struct var **list = assoc_list(vars, base, &n);
+	const struct assoc *a = find_assoc(vars, base);
 	size_t base_len = strlen(base);
+	struct var **list;
 	struct var *const *v;
 	char *s = NULL;
 
-	qsort(list, n, sizeof(*list), cmp_seq);
-	for (v = list; v != list + n; v++) {
+	if (!a || !a->n)
+		return NULL;
+	list = alloc_type_n(struct var *, a->n);
+	memcpy(list, a->elems, sizeof(struct var *) * a->n);
+	qsort(list, a->n, sizeof(*list), cmp_seq);
+	for (v = list; v != list + a->n; v++) {
 		if (s)
 			s = stralloc_append(s, " ");
 		s = stralloc_append(s, (*v)->name + base_len + 1);
@@ -113,70 +308,82 @@ char *var_get_keys(struct var *vars, const char *base)
 }
 
 
-void var_unset_assoc(struct var **vars, const char *base)
+void var_unset_assoc(struct vars *vars, const char *base)
 {
-	struct var **anchor = vars;
-	size_t base_len = strlen(base);
-
-	while (*anchor) {
-		struct var *v = *anchor;
-
-		if (!strncmp(v->name, base, base_len) &&
-		    v->name[base_len] == '_' && v->assoc) {
-			*anchor = v->next;
-			free(v->name);
-			free_value(v->value);
-			free(v);
-		} else {
-			anchor = &(*anchor)->next;
-		}
-	}
+	struct assoc *a = find_assoc(vars, base);
+	unsigned i;
+
+	if (!a)
+		return;
+	for (i = 0; i != a->n; i++)
+		remove_var(vars, a->elems[i]);
+	a->n = 0;
 }
 
 
 /* ----- Get and  dump variables ------------------------------------------- */
 
 
-const struct var *var_get_var(const struct var *vars, const char *name,
+const struct var *var_get_var(const struct vars *vars, const char *name,
     const char *key)
 {
-	const struct var *v;
-	char *n = NULL;
-
-	if (key) {
-		asprintf_req(&n, "%s_%s", name, key);
-		name = n;
-	}
-	for (v = vars; v; v = v->next) {
-		if (key && !v->assoc)
-			continue;
-		if (!key && v->assoc)
-			continue;
-		if (!strcmp(v->name, name))
-			break;
-	}
-	free(n);
+	const struct var *v = find(vars, name, key, hash_name(name, key));
+
+	if (!v)
+		return NULL;
+	if (key && !v->assoc)
+		return NULL;
+	if (!key && v->assoc)
+		return NULL;
 	return v;
 }
 
 
-const struct value *var_get(const struct var *vars, const char *name,
+const struct value *var_get(const struct vars *vars, const char *name,
     const char *key)
 {
 	const struct var *v = var_get_var(vars, name, key);
-
-	return v ? v->value : NULL;
+	const struct cfgvar *cv;
+
+	if (v)
+		return v->value;
+	if (key || !vars->base)
+		return NULL;
+	cv = config_get(vars->base, name);
+	return cv && !cv->keys && !cv->elem ? &cv->v : NULL;
 }
 
 
-void dump_vars(const struct var *vars)
+/*
+ * Variables we read from the base configuration are shown with "(base)"
+ * instead of a sequence number.
+ */
+
+void dump_vars(struct vars *vars)
 {
-	const struct var *v;
+	const struct var *v = vars_sorted(vars);
+	const struct cfgvar *cv = vars->base ? vars->base->vars : NULL;
+	int cmp;
 
-	for (v = vars; v; v = v->next) {
+	while (v || cv) {
+		if (cv && (cv->keys || cv->elem)) {
+			cv = cv->next;
+			continue;
+		}
+		cmp = !v ? -1 : !cv ? 1 : strcmp(cv->name, v->name);
+		if (cmp < 0) {
+			printf("%s = ", cv->name);
+			dump_value(&cv->v);
+			printf(" (base)\n");
+			cv = cv->next;
+			continue;
+		}
+		if (!cmp)
+			cv = cv->next;
 		printf("%s = ", v->name);
 		dump_value(v->value);
 		printf(" (%u)%s\n", v->seq, v->assoc ? " assoc" : "");
+		v = v->next;
 	}
 }
 
@@ -184,28 +391,35 @@ void dump_vars(const struct var *vars)
 /* ----- Set variables ----------------------------------------------------- */
 
 
-void var_set(struct var **vars, const char *name, const char *key,
+void var_set(struct vars *vars, const char *name, const char *key,
     struct value *value, const struct validate *val)
 {
-	struct var **anchor = vars;
-	char *n = NULL;
+	uint32_t hash = hash_name(name, key);
 	struct var *v;
 
-	if (key) {
-		asprintf_req(&n, "%s_%s", name, key);
-		name = n;
-	}
-
 	if (val) {
-		switch (validate(val, name, value->s)) {
+		const struct cfgvar *cv = NULL;
+		char *n = NULL;
+		unsigned res;
+
+		if (key)
+			asprintf_req(&n, "%s_%s", name, key);
+		if (vars->base)
+			cv = config_get(vars->base, n ? n : name);
+		/* the miner already accepted the value it has */
+		if (cv && !strcmp(cv->value, value->s))
+			res = 2;
+		else
+			res = validate(val, n ? n : name, value->s);
+		switch (res) {
 		case 0:
-			errorf("unrecognized variable '%s'", name);
+			errorf("unrecognized variable '%s'", n ? n : name);
 			free(n);
 			free_value(value);
 			return;
 		case 1:
 			errorf("invalid value '%s' for variable %s",
-			    value->s, name);
+			    value->s, n ? n : name);
 			free(n);
 			free_value(value);
 			return;
@@ -214,53 +428,65 @@ void var_set(struct var **vars, const char *name, const char *key,
 		default:
 			abort();
 		}
+		free(n);
 	}
 
-	for (anchor = vars; *anchor; anchor = &(*anchor)->next) {
-		int cmp;
-
-		v = *anchor;
-		cmp = strcmp(name, v->name);
-		if (!cmp) {
-			if ((v->assoc && !key) || (!v->assoc && key)) {
-				errorf("'%s' is used with and without key",
-				    name);
-				return;
-			}
-			free(n);
-			free_value(v->value);
-			v->value = value;
-			v->seq = sequence++;
+	v = find(vars, name, key, hash);
+	if (v) {
+		if ((v->assoc && !key) || (!v->assoc && key)) {
+			errorf("'%s' is used with and without key", v->name);
+			free_value(value);
 			return;
 		}
-		if (cmp < 0)
-			break;
+		free_value(v->value);
+		v->value = value;
+		v->seq = sequence++;
+		return;
 	}
+
+	if (vars->n == vars->n_buckets)
+		grow(vars);
+
 	v = alloc_type(struct var);
-	v->name = stralloc(name);
+	if (key)
+		asprintf_req(&v->name, "%s_%s", name, key);
+	else
+		v->name = stralloc(name);
 	v->value = value;
 	v->seq = sequence++;
 	v->assoc = key;
-	v->next = *anchor;
-	*anchor = v;
-	free(n);
+	v->hash = hash;
+	link_var(vars, v);
+	if (key)
+		add_elem(vars, name, v);
 }
 
 
 /* ----- Freeing ----------------------------------------------------------- */
 
 
-void free_vars(struct var *v)
+void free_vars(struct vars *vars)
 {
-	struct var *next;
-
-	while (v) {
+	struct var *v, *next;
+	struct assoc *a;
+
+	if (!vars)
+		return;
+	while (vars->assoc) {
+		a = vars->assoc;
+		vars->assoc = a->next;
+		free(a->base);
+		free(a->elems);
+		free(a);
+	}
+	for (v = vars->list; v; v = next) {
 		next = v->next;
 		free(v->name);
 		free_value(v->value);
 		free(v);
-		v = next;
 	}
+	free(vars->buckets);
+	free(vars);
 }
 
 
@@ -11,11 +11,13 @@
 #define	VAR_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "validate.h"
 
 
 struct value;
+struct config;
 
 struct var {
 	char *name;
@@ -23,24 +25,76 @@ struct var {
 	unsigned seq;
 	bool assoc;	/* was set with name[key] = ... or comes from
 			   associative configuration variable */
-	struct var *next;
+	uint32_t hash;		/* of the name */
+	struct var *chain;	/* next in the same hash bucket */
+	struct var *next;	/* next in the list of all variables */
+	struct var **prev;	/* pointer to us in the list */
 };
 
+/*
+ * An associative array has the elements base[key], which are variables named
+ * base_key. The array lists its elements, so that we can operate on them
+ * without searching all the variables.
+ */
 
-const struct var *var_get_var(const struct var *vars, const char *name,
+struct assoc {
+	char *base;
+	struct var **elems;	/* in order of creation */
+	unsigned n;
+	unsigned size;		/* allocated size of "elems" */
+	struct assoc *next;
+};
+
+/*
+ * Variables are found through a hash table (with chaining). They are also
+ * kept in a list, which is only sorted by name when vars_sorted is called.
+ *
+ * If there is a base configuration, var_get falls back to its plain variables
+ * (i.e., not DEST or its elements), so that they don't have to be copied.
+ */
+
+struct vars {
+	struct var **buckets;
+	unsigned n_buckets;	/* power of two */
+	unsigned n;		/* number of variables */
+	struct var *list;
+	bool sorted;		/* list is sorted by name */
+	struct assoc *assoc;	/* associative arrays */
+	struct config *base;	/* base configuration, NULL if none */
+};
+
+
+struct vars *vars_new(void);
+
+/* var_get_var ignores the base configuration */
+const struct var *var_get_var(const struct vars *vars, const char *name,
     const char *key);
-const struct value *var_get(const struct var *vars, const char *name,
+const struct value *var_get(const struct vars *vars, const char *name,
     const char *key);
 
-void var_set_keys(struct var *vars, const char *base, const char *keys);
-char *var_get_keys(struct var *vars, const char *base);
-void var_unset_assoc(struct var **vars, const char *base);
+/*
+ * var_assoc returns the elements of the associative array "base", in no
+ * particular order, and sets *n to their number. var_assoc_sorted returns
+ * them sorted by name, in an array the caller frees.
+ */
+
+struct var *const *var_assoc(const struct vars *vars, const char *base,
+    unsigned *n);
+struct var **var_assoc_sorted(const struct vars *vars, const char *base,
+    unsigned *n);
+
+void var_set_keys(struct vars *vars, const char *base, const char *keys);
+char *var_get_keys(struct vars *vars, const char *base);
+void var_unset_assoc(struct vars *vars, const char *base);
+
+/* return the list of variables, sorted by name */
+const struct var *vars_sorted(struct vars *vars);
 
-void dump_vars(const struct var *vars);
+void dump_vars(struct vars *vars);
 
-void var_set(struct var **vars, const char *name, const char *key,
+void var_set(struct vars *vars, const char *name, const char *key,
     struct value *value, const struct validate *val);
-void free_vars(struct var *var);
+void free_vars(struct vars *vars);
 void var_reset_sequence(void);
 
 #endif /* !VAR_H */
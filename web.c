@@ -18,6 +18,7 @@
 #include "alloc.h"
 #include "validate.h"
 #include "api.h"
+#include "testall.h"
 #include "web.h"
 
 
@@ -191,6 +192,8 @@ char *web_get(const char *uri, const char *version, unsigned *len)
 		s = get_path(1);
 	} else if (!strcmp(uri, "/path?type=active")) {
 		s = get_path(0);
+	} else if (!strcmp(uri, "/test-all")) {
+		s = test_all_json();
 	} else {
 		res = consider_file(*uri == '/' ? uri + 1 : uri, version, len);
 		if (res)
@@ -241,6 +244,8 @@ char *web_post(const char *uri, const char *version, const char *body,
 		s = run_with_id(body, miner_run);
 	} else if (!strcmp(uri, "/reload")) {
 		s = miner_reload();
+	} else if (!strcmp(uri, "/test-all")) {
+		s = test_all_start();
 	}
 
 	if (s)